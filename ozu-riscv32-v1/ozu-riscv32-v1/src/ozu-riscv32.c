@@ -3,6 +3,14 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "ozu-riscv32.h"
 
@@ -12,12 +20,31 @@
 void help() {        
 	printf("------------------------------------------------------------------\n\n");
 	printf("\t**********OZU-RV32 Disassembler and Simulator Help MENU**********\n\n");
-	printf("sim\t-- simulate program to completion \n");
+	printf("options: --stats[=<file>]\t-- print JSON run statistics after each run\n");
+	printf("         --mmap\t\t\t-- flat guest memory, accesses outside the regions stop the program\n");
+	printf("         --heatmap\t\t-- start with the memory-access heatmap on\n");
+	printf("         --harts <n>\t\t-- simulate <n> harts sharing memory, each on its own thread\n");
+	printf("         --quantum <n>\t\t-- instructions per hart between store buffer commits (default %d, at most %d)\n", HART_DEFAULT_QUANTUM, HART_MAX_QUANTUM);
+	printf("         --compare <log>\t-- check the program against a Whisper instruction log and exit\n");
+	printf("         --fuzz <n>\t\t-- run <n> random programs on every engine, compare the results and exit\n");
+	printf("         --roundtrip\t\t-- check decode/encode/disassembly of every 32-bit word and exit\n\n");
+	printf("sim\t-- simulate program to completion in the background\n");
+	printf("stop\t-- pause a running simulation (also Ctrl-C)\n");
 	printf("run <n>\t-- simulate program for <n> instructions\n");
+	printf("sample <skip> <window>\t-- fast-forward <skip>, then simulate <window> instructions in detail, repeatedly\n");
+	printf("trace\t-- toggle printing of each instruction simulated in detail\n");
+	printf("record [<MB>]\t-- toggle recording for reverse execution, or record into <MB> of undo log\n");
+	printf("rstep <n>\t-- step back <n> recorded instructions\n");
+	printf("rcontinue\t-- step back to the previous breakpoint/watchpoint or the oldest recorded state\n");
+	printf("break <addr>\t-- set/clear a breakpoint at <addr>\n");
+	printf("watch <addr> [r|w|rw]\t-- set/clear a watchpoint on the word at <addr>\n");
+	printf("hart <n>\t-- show hart <n> in rdump and set its registers with input\n");
+	printf("heatmap\t-- toggle the memory-access heatmap of the instructions run in detail, reported after each run\n");
 	printf("rdump\t-- dump register values\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
 	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
+	printf("mdump --raw <file> <start> <stop>\t-- write memory from <start> to <stop> address to <file>\n");
 	printf("print\t-- print the program loaded into memory\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
@@ -25,11 +52,16 @@ void help() {
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                              */
+/* Raw word access to the memory backend                       */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+static inline uint32_t memory_read_32(uint32_t address)
 {
 	int i;
+	if (GUEST_BASE) {
+		uint32_t value;
+		memcpy(&value, GUEST_BASE + address, 4);	/* little-endian host */
+		return value;
+	}
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
 			uint32_t offset = address - MEM_REGIONS[i].begin;
@@ -39,88 +71,1613 @@ uint32_t mem_read_32(uint32_t address)
 					(MEM_REGIONS[i].mem[offset+0] <<  0);
 		}
 	}
-	return 0;
+	return 0;
+}
+
+/* runs of stores to one page update the bitmap once */
+static inline void mark_written(uint32_t address)
+{
+	uint32_t page = address >> GUEST_PAGE_SHIFT;
+	if (page != LAST_WRITTEN_PAGE) {
+		LAST_WRITTEN_PAGE = page;
+		WRITTEN_PAGES[page >> 3] |= 1 << (page & 7);
+	}
+}
+
+/* the low <bytes> bytes of value, little-endian */
+static inline void memory_write(uint32_t address, uint32_t value, int bytes)
+{
+	int i, j;
+	uint32_t offset;
+	mark_written(address);
+	if ((address & ((1 << GUEST_PAGE_SHIFT) - 1)) + bytes > (1 << GUEST_PAGE_SHIFT)) {
+		mark_written(address + bytes - 1);
+	}
+	if (GUEST_BASE) {
+		memcpy(GUEST_BASE + address, &value, bytes);
+		return;
+	}
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
+			offset = address - MEM_REGIONS[i].begin;
+
+			for (j = 0; j < bytes; j++) {
+				MEM_REGIONS[i].mem[offset+j] = (value >> (8 * j)) & 0xFF;
+			}
+		}
+	}
+}
+
+static inline void memory_write_32(uint32_t address, uint32_t value)
+{
+	memory_write(address, value, 4);
+}
+
+/***************************************************************/
+/* Store buffers. Entries hold whole aligned words with a mask */
+/* of the bytes written; a misaligned store fills two entries. */
+/***************************************************************/
+
+/* store_entry_t.mask expanded to bits */
+static const uint32_t BYTE_MASK[16] = {
+	0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF, 0x00FF0000, 0x00FF00FF, 0x00FFFF00, 0x00FFFFFF,
+	0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF, 0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF,
+};
+
+/* room for every store of a quantum (two entries each) at half load */
+static int store_buffer_init(store_buffer_t *b, uint32_t quantum) {
+	uint32_t capacity = 64;
+	while (capacity < 4 * (uint64_t) quantum) {
+		capacity *= 2;
+	}
+	if (b->capacity >= capacity) {
+		return TRUE;
+	}
+	free(b->slots);
+	free(b->order);
+	b->slots = calloc(capacity, sizeof(store_entry_t));
+	b->order = malloc(capacity * sizeof(uint32_t));
+	b->capacity = b->slots && b->order ? capacity : 0;
+	b->used = 0;
+	return b->capacity != 0;
+}
+
+static store_entry_t *store_buffer_slot(store_buffer_t *b, uint32_t word) {
+	uint32_t i = (word >> 2) & (b->capacity - 1);
+	while (b->slots[i].mask && b->slots[i].address != word) {
+		i = (i + 1) & (b->capacity - 1);
+	}
+	if (b->slots[i].mask == 0) {
+		b->slots[i].address = word;
+		b->order[b->used++] = i;
+	}
+	return &b->slots[i];
+}
+
+static void store_buffer_put(store_buffer_t *b, uint32_t word, uint32_t value, uint32_t mask) {
+	store_entry_t *e = store_buffer_slot(b, word);
+	uint32_t bits = BYTE_MASK[mask];
+	e->value = (e->value & ~bits) | (value & bits);
+	e->mask |= mask;
+}
+
+static void store_buffer_write(store_buffer_t *b, uint32_t address, uint32_t value, int bytes) {
+	uint32_t shift = address & 3;
+	uint32_t mask = ((1 << bytes) - 1) << shift;	/* may run into the next word */
+	if (GUEST_BASE) {
+		/* touch the target now so a bad store faults in its own instruction */
+		volatile uint8_t probe = GUEST_BASE[address] | GUEST_BASE[(uint64_t) address + bytes - 1];
+		(void) probe;
+	} else if (guest_to_host(address, NULL) == NULL) {
+		return;
+	}
+	store_buffer_put(b, address & ~3, value << (8 * shift), mask & 0xF);
+	if (mask > 0xF) {
+		store_buffer_put(b, (address & ~3) + 4, value >> (32 - 8 * shift), mask >> 4);
+	}
+}
+
+/* a word read from memory with the hart's own pending stores on top */
+static uint32_t store_buffer_merge(store_buffer_t *b, uint32_t address, uint32_t value) {
+	uint32_t shift = address & 3, i, word;
+	uint64_t bytes = (uint64_t) value << (8 * shift);
+
+	for (i = 0; i < (shift ? 2 : 1); i++) {
+		word = (address & ~3) + 4 * i;
+		uint32_t slot = (word >> 2) & (b->capacity - 1);
+		while (b->slots[slot].mask && b->slots[slot].address != word) {
+			slot = (slot + 1) & (b->capacity - 1);
+		}
+		if (b->slots[slot].mask) {
+			uint64_t bits = (uint64_t) BYTE_MASK[b->slots[slot].mask] << (32 * i);
+			bytes = (bytes & ~bits) | (((uint64_t) b->slots[slot].value << (32 * i)) & bits);
+		}
+	}
+	return bytes >> (8 * shift);
+}
+
+/* write the buffer to memory in program order and empty it */
+static void store_buffer_commit(store_buffer_t *b) {
+	uint32_t i;
+	for (i = 0; i < b->used; i++) {
+		store_entry_t *e = &b->slots[b->order[i]];
+		uint32_t bits = BYTE_MASK[e->mask];
+		if (bits != 0xFFFFFFFF) {
+			e->value = (memory_read_32(e->address) & ~bits) | (e->value & bits);
+		}
+		memory_write_32(e->address, e->value);
+		e->mask = 0;
+	}
+	b->used = 0;
+}
+
+/***************************************************************/
+/* Read a 32-bit word from memory                              */
+/***************************************************************/
+uint32_t mem_read_32(uint32_t address)
+{
+	uint32_t value = memory_read_32(address);
+	if (HART->stores.used) {
+		value = store_buffer_merge(&HART->stores, address, value);
+	}
+	return value;
+}
+
+/***************************************************************/
+/* Write the low 1, 2 or 4 bytes of value to memory            */
+/***************************************************************/
+static inline void mem_write(uint32_t address, uint32_t value, int bytes)
+{
+	if (HART->buffered) {
+		store_buffer_write(&HART->stores, address, value, bytes);
+		return;
+	}
+	memory_write(address, value, bytes);
+	if (STORE_HOOK) {
+		STORE_HOOK(address, value, bytes);
+	}
+}
+
+void mem_write_32(uint32_t address, uint32_t value)
+{
+	mem_write(address, value, 4);
+}
+
+void mem_write_16(uint32_t address, uint32_t value)
+{
+	mem_write(address, value & 0xFFFF, 2);
+}
+
+void mem_write_8(uint32_t address, uint32_t value)
+{
+	mem_write(address, value & 0xFF, 1);
+}
+
+/***************************************************************/
+/* Read a word for the tools (disassembler etc.) that never    */
+/* faults: unmapped addresses read as 0.                       */
+/***************************************************************/
+uint32_t mem_peek_32(uint32_t address)
+{
+	uint64_t avail;
+	if (GUEST_BASE && (guest_to_host(address, &avail) == NULL || avail < 4)) {
+		return 0;
+	}
+	return mem_read_32(address);
+}
+
+/***************************************************************/
+/* SIGSEGV on the guest reservation: leave the instruction and */
+/* jump back to the run loop that armed FAULT_JMP.             */
+/***************************************************************/
+static void guest_fault_handler(int signo, siginfo_t *info, void *context) {
+	uint8_t *host = info->si_addr;
+	if (FAULT_ARMED && host >= GUEST_BASE && host < GUEST_BASE + GUEST_SPAN) {
+		FAULT_ADDRESS = host - GUEST_BASE;
+		siglongjmp(FAULT_JMP, 1);
+	}
+	/* not ours, crash as usual when the access is retried */
+	signal(SIGSEGV, SIG_DFL);
+}
+
+/* report a guest fault after the jump back, the instruction did not complete */
+void guest_fault() {
+	FAULT_ARMED = FALSE;
+	RUN_FLAG = FALSE;
+	if (UNDO_LOG) {
+		undo_unrecord();
+	}
+	if (HART_COUNT > 1) {
+		printf("Error: illegal memory access at 0x%08x by instruction at 0x%08x on hart %u\n\n", FAULT_ADDRESS, CURRENT_STATE.PC, HART->hartid);
+		return;
+	}
+	printf("Error: illegal memory access at 0x%08x by instruction at 0x%08x\n\n", FAULT_ADDRESS, CURRENT_STATE.PC);
+}
+
+/***************************************************************/
+/* Reserve the 4 GB guest space and open up the regions        */
+/***************************************************************/
+void init_guest_space() {
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t huge = 2 << 20;
+	uint8_t *reservation;
+	int i;
+
+	/* one guard page past 4 GB catches words that wrap the top */
+	GUEST_SPAN = GUEST_SPACE + page_size;
+	reservation = mmap(NULL, GUEST_SPAN + huge, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reservation == MAP_FAILED) {
+		printf("Error: Can't reserve the guest address space\n");
+		exit(-1);
+	}
+	/* hugepage-align guest 0 so the hot ranges can use them */
+	GUEST_BASE = (uint8_t *) (((uintptr_t) reservation + huge - 1) & ~(uintptr_t)(huge - 1));
+
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		uint64_t size = (uint64_t) MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+		MEM_REGIONS[i].mem = GUEST_BASE + MEM_REGIONS[i].begin;
+		if (mprotect(MEM_REGIONS[i].mem, size, PROT_READ | PROT_WRITE) != 0) {
+			printf("Error: Can't map guest memory region %d\n", i);
+			exit(-1);
+		}
+	}
+	madvise(GUEST_BASE + MEM_TEXT_BEGIN, GUEST_HOT_SIZE, MADV_HUGEPAGE);
+	madvise(GUEST_BASE + MEM_DATA_BEGIN, GUEST_HOT_SIZE, MADV_HUGEPAGE);
+	madvise(GUEST_BASE + (uint64_t) MEM_STACK_BEGIN + 1 - GUEST_HOT_SIZE, GUEST_HOT_SIZE, MADV_HUGEPAGE);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = guest_fault_handler;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;	/* we leave by siglongjmp */
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+/***************************************************************/
+/* Execute one cycle                                           */
+/***************************************************************/
+void cycle() {                                                
+	uint32_t instruction;
+	if (TRACE_FLAG) {
+		printf("[0x%08x]\t", CURRENT_STATE.PC);
+		print_instruction(CURRENT_STATE.PC);
+	}
+	if (HEAT_MAP) {
+		heat_instruction();
+	}
+	instruction = handle_instruction();
+	CURRENT_STATE = NEXT_STATE;
+	INSTRUCTION_COUNT++;
+	/* one counter per opcode; loads/stores/branches are summed from these when reported */
+	OPCODE_COUNT[instruction & 127]++;
+}
+
+/***************************************************************/
+/* Functional fast path: no tracing or heatmap. Instructions   */
+/* and opcodes are counted one by one, so a fault keeps the    */
+/* ones before it and --stats stays exact.                     */
+/***************************************************************/
+uint64_t fast_forward(uint64_t num_instructions) {
+	uint64_t start = INSTRUCTION_COUNT;
+	if (HART_COUNT > 1) {
+		harts_run(num_instructions);
+		return INSTRUCTION_COUNT - start;
+	}
+	if (GUEST_BASE) {
+		/* a guest fault jumps back here, the instruction did not complete */
+		FAULT_ARMED = TRUE;
+		if (sigsetjmp(FAULT_JMP, 0)) {
+			guest_fault();
+			return INSTRUCTION_COUNT - start;
+		}
+	}
+	while (INSTRUCTION_COUNT - start < num_instructions && RUN_FLAG) {
+		uint64_t left = num_instructions - (INSTRUCTION_COUNT - start);
+		uint64_t block = left < SIM_BLOCK ? left : SIM_BLOCK;
+		uint64_t i;
+		if (BREAK_COUNT || WATCH_COUNT) {
+			debug_steps(block, FALSE);
+		} else {
+			for (i = 0; i < block && RUN_FLAG; i++) {
+				OPCODE_COUNT[handle_instruction() & 127]++;
+				CURRENT_STATE = NEXT_STATE;
+				INSTRUCTION_COUNT++;
+			}
+		}
+		if (DEBUG_HIT || sim_poll()) {
+			break;
+		}
+	}
+	FAULT_ARMED = FALSE;
+	return INSTRUCTION_COUNT - start;
+}
+
+/***************************************************************/
+/* Run up to n instructions through cycle(), checking for      */
+/* stop/pause requests between blocks. TRUE if stopped.        */
+/***************************************************************/
+int cycle_blocks(uint64_t num_instructions) {
+	if (HART_COUNT > 1) {
+		return harts_run(num_instructions);
+	}
+	if (GUEST_BASE) {
+		FAULT_ARMED = TRUE;
+		if (sigsetjmp(FAULT_JMP, 0)) {
+			guest_fault();
+			return FALSE;
+		}
+	}
+	while (num_instructions > 0 && RUN_FLAG) {
+		uint64_t block = num_instructions < SIM_BLOCK ? num_instructions : SIM_BLOCK;
+		uint64_t i;
+		if (BREAK_COUNT || WATCH_COUNT) {
+			i = debug_steps(block, TRUE);
+		} else {
+			for (i = 0; i < block && RUN_FLAG; i++) {
+				cycle();
+			}
+		}
+		num_instructions -= i;
+		if (DEBUG_HIT || sim_poll()) {
+			FAULT_ARMED = FALSE;
+			return TRUE;
+		}
+	}
+	FAULT_ARMED = FALSE;
+	return FALSE;
+}
+
+/***************************************************************/
+/* Put every hart at the start of the program                  */
+/***************************************************************/
+void init_harts() {
+	uint32_t i;
+	for (i = 0; i < MAX_HARTS; i++) {
+		hart_t *h = &HARTS[i];
+		memset(&h->current, 0, sizeof(CPU_State));
+		h->current.PC = MEM_TEXT_BEGIN;
+		h->next = h->current;
+		h->run_flag = TRUE;
+		h->instruction_count = 0;
+		memset(h->opcode_count, 0, sizeof(h->opcode_count));
+		h->hartid = i;
+	}
+}
+
+int harts_running() {
+	uint32_t i;
+	for (i = 0; i < HART_COUNT; i++) {
+		if (HARTS[i].run_flag) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+uint64_t harts_instructions() {
+	uint64_t total = 0;
+	uint32_t i;
+	for (i = 0; i < HART_COUNT; i++) {
+		total += HARTS[i].instruction_count;
+	}
+	return total;
+}
+
+/* the opcode counters of all harts added up, counts has 128 entries */
+void harts_opcode_count(uint64_t *counts) {
+	uint32_t i, j;
+	memset(counts, 0, 128 * sizeof(uint64_t));
+	for (i = 0; i < HART_COUNT; i++) {
+		for (j = 0; j < 128; j++) {
+			counts[j] += HARTS[i].opcode_count[j];
+		}
+	}
+}
+
+/***************************************************************/
+/* Multi-hart runs. Every hart has a host thread (hart 0 uses  */
+/* the caller's) and runs one quantum between two barriers;    */
+/* hart 0 then commits the store buffers in hart order.        */
+/***************************************************************/
+static struct {
+	pthread_barrier_t start, done;
+	uint64_t quantum;	/* instructions per hart this round */
+	int go;			/* FALSE sends the hart threads home */
+} SCHED;
+
+/* one quantum of the calling thread's hart */
+static void hart_quantum() {
+	uint64_t i;
+	if (GUEST_BASE) {
+		FAULT_ARMED = TRUE;
+		if (sigsetjmp(FAULT_JMP, 0)) {
+			guest_fault();
+			return;
+		}
+	}
+	/* counted one by one, a faulting instruction leaves the count at the ones before it */
+	for (i = 0; i < SCHED.quantum && RUN_FLAG; i++) {
+		OPCODE_COUNT[handle_instruction() & 127]++;
+		CURRENT_STATE = NEXT_STATE;
+		INSTRUCTION_COUNT++;
+	}
+	FAULT_ARMED = FALSE;
+}
+
+static void *hart_thread(void *arg) {
+	HART = arg;
+	while (1) {
+		pthread_barrier_wait(&SCHED.start);
+		if (!SCHED.go) {
+			break;
+		}
+		hart_quantum();
+		pthread_barrier_wait(&SCHED.done);
+	}
+	return NULL;
+}
+
+/* TRUE (and says why) if the debugging tools in use need a single hart */
+int harts_refuse() {
+	if (HART_COUNT > 1 && (UNDO_LOG || HEAT_MAP || BREAK_COUNT || WATCH_COUNT)) {
+		printf("record, heatmap, break and watch need a single hart (--harts 1).\n\n");
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* run every hart for up to n instructions, TRUE if stopped; */
+/* the callers have checked harts_refuse()                   */
+int harts_run(uint64_t num_instructions) {
+	pthread_t threads[MAX_HARTS];
+	hart_t *shown = HART;
+	int stopped = FALSE;
+	uint32_t i;
+
+	for (i = 0; i < HART_COUNT; i++) {
+		if (!store_buffer_init(&HARTS[i].stores, HART_QUANTUM)) {
+			printf("Error: Can't allocate store buffers\n");
+			return FALSE;
+		}
+		HARTS[i].buffered = TRUE;
+	}
+	pthread_barrier_init(&SCHED.start, NULL, HART_COUNT);
+	pthread_barrier_init(&SCHED.done, NULL, HART_COUNT);
+	SCHED.go = TRUE;
+	for (i = 1; i < HART_COUNT; i++) {
+		if (pthread_create(&threads[i], NULL, hart_thread, &HARTS[i]) != 0) {
+			printf("Error: Can't start hart %u\n", i);
+			exit(-1);
+		}
+	}
+
+	HART = &HARTS[0];
+	while (num_instructions > 0 && harts_running()) {
+		SCHED.quantum = num_instructions < HART_QUANTUM ? num_instructions : HART_QUANTUM;
+		pthread_barrier_wait(&SCHED.start);
+		hart_quantum();
+		pthread_barrier_wait(&SCHED.done);
+		for (i = 0; i < HART_COUNT; i++) {
+			store_buffer_commit(&HARTS[i].stores);
+		}
+		num_instructions -= SCHED.quantum;
+		if (sim_poll()) {
+			stopped = TRUE;
+			break;
+		}
+	}
+
+	SCHED.go = FALSE;
+	pthread_barrier_wait(&SCHED.start);
+	for (i = 1; i < HART_COUNT; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_barrier_destroy(&SCHED.start);
+	pthread_barrier_destroy(&SCHED.done);
+	for (i = 0; i < HART_COUNT; i++) {
+		HARTS[i].buffered = FALSE;
+	}
+	HART = shown;
+	return stopped;
+}
+
+/***************************************************************/
+/* Simulate RISC-V for n cycles                                */
+/***************************************************************/
+void run(int num_cycles) {                                      
+	
+	if (!harts_running()) {
+		printf("Simulation Stopped\n\n");
+		return;
+	}
+	if (harts_refuse()) {
+		return;
+	}
+
+	printf("Running simulator for %d cycles...\n\n", num_cycles);
+	double start = now_seconds();
+	uint64_t first = INSTRUCTION_COUNT;
+	if (cycle_blocks(num_cycles)) {
+		printf("Simulation Paused at 0x%08x.\n\n", CURRENT_STATE.PC);
+	} else if (!harts_running() && INSTRUCTION_COUNT - first < (uint64_t) num_cycles) {
+		printf("Simulation Stopped.\n\n");
+	}
+	STATS.run_time += now_seconds() - start;
+	if (STATS_FLAG) {
+		print_stats();
+	}
+	print_heatmap();
+}
+
+/***************************************************************/
+/* simulate to completion                                      */
+/***************************************************************/
+void runAll() {                                                     
+	if (!harts_running()) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+	if (harts_refuse()) {
+		return;
+	}
+
+	printf("Simulation Started...\n\n");
+	double start = now_seconds();
+	if (cycle_blocks(UINT64_MAX)) {
+		printf("Simulation Paused at 0x%08x.\n\n", CURRENT_STATE.PC);
+	} else {
+		printf("Simulation Finished.\n\n");
+	}
+	STATS.run_time += now_seconds() - start;
+	if (STATS_FLAG) {
+		print_stats();
+	}
+	print_heatmap();
+}
+
+/***************************************************************/
+/* Sampled simulation: fast-forward <skip> instructions, then  */
+/* run <window> instructions in detail, until the program ends */
+/* The heatmap only sees the detailed windows.                 */
+/***************************************************************/
+void sample(uint32_t skip, uint32_t window) {
+	uint64_t before[128], after[128];
+	uint64_t start_count = harts_instructions();
+	uint64_t detailed = 0, loads = 0, stores = 0, branches = 0;
+	double detailed_time = 0;
+	int windows = 0;
+
+	if (RUN_FLAG == FALSE) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+	if (window == 0) {
+		printf("Sample window must be at least one instruction.\n\n");
+		return;
+	}
+	if (harts_refuse()) {
+		return;
+	}
+
+	printf("Sampling: fast-forward %u, detail %u instructions...\n\n", skip, window);
+	printf("[Window]\t[Start]\t\t[Instrs]\t[Loads]\t[Stores]\t[Branches]\t[MIPS]\n");
+	double start = now_seconds();
+	while (RUN_FLAG) {
+		fast_forward(skip);
+		if (RUN_FLAG == FALSE || DEBUG_HIT || sim_poll()) {
+			break;
+		}
+
+		/* every hart's instructions count, like in print_stats() */
+		uint64_t window_start = harts_instructions();
+		harts_opcode_count(before);
+		double t = now_seconds();
+		int stopped = cycle_blocks(window);
+		t = now_seconds() - t;
+
+		uint64_t n = harts_instructions() - window_start;
+		harts_opcode_count(after);
+		uint64_t l = after[0b0000011] - before[0b0000011];
+		uint64_t s = after[0b0100011] - before[0b0100011];
+		uint64_t b = after[0b1100011] - before[0b1100011];
+		printf("%d\t\t%llu\t\t%llu\t\t%llu\t%llu\t\t%llu\t\t%.3f\n", windows,
+			(unsigned long long) window_start, (unsigned long long) n,
+			(unsigned long long) l, (unsigned long long) s, (unsigned long long) b,
+			t > 0 ? n / t / 1e6 : 0.0);
+
+		windows++;
+		detailed += n;
+		detailed_time += t;
+		loads += l;
+		stores += s;
+		branches += b;
+		if (stopped) {
+			break;
+		}
+	}
+	STATS.run_time += now_seconds() - start;
+
+	/* scale the detailed windows up to the whole run */
+	uint64_t total = harts_instructions() - start_count;
+	printf("\nSampling Finished: %llu instructions, %d windows, %llu in detail.\n",
+		(unsigned long long) total, windows, (unsigned long long) detailed);
+	if (detailed > 0) {
+		double scale = (double) total / detailed;
+		printf("Estimated loads\t\t: %.0f\n", loads * scale);
+		printf("Estimated stores\t: %.0f\n", stores * scale);
+		printf("Estimated branches\t: %.0f\n", branches * scale);
+		printf("Estimated detailed time\t: %.6f s\n", detailed_time * scale);
+	}
+	printf("\n");
+	if (STATS_FLAG) {
+		print_stats();
+	}
+	print_heatmap();
+}
+
+/***************************************************************/
+/* Run instructions while checking breakpoints and watchpoints */
+/* (one table lookup each). Returns instructions executed.     */
+/***************************************************************/
+uint64_t debug_steps(uint64_t num_instructions, int detailed) {
+	uint64_t i;
+	for (i = 0; i < num_instructions && RUN_FLAG; i++) {
+		uint32_t offset = CURRENT_STATE.PC - MEM_TEXT_BEGIN;
+		if (BREAK_MAP && offset < TEXT_WORDS * 4 && BREAK_MAP[offset >> 2] && !STEP_OVER) {
+			printf("Breakpoint at 0x%08x\n", CURRENT_STATE.PC);
+			DEBUG_HIT = TRUE;
+			BREAK_STOPPED = TRUE;
+			BREAK_STOP_PC = CURRENT_STATE.PC;
+			break;
+		}
+		STEP_OVER = FALSE;
+		if (detailed) {
+			cycle();
+		} else {
+			OPCODE_COUNT[handle_instruction() & 127]++;
+			CURRENT_STATE = NEXT_STATE;
+			INSTRUCTION_COUNT++;
+		}
+		if (DEBUG_HIT) {
+			return i + 1;
+		}
+	}
+	return i;
+}
+
+/***************************************************************/
+/* Toggle a breakpoint on a text address                       */
+/***************************************************************/
+void set_breakpoint(uint32_t address) {
+	uint32_t offset = address - MEM_TEXT_BEGIN;
+	if (offset >= TEXT_WORDS * 4 || (address & 3)) {
+		printf("Breakpoints must be on a word in the text segment.\n\n");
+		return;
+	}
+	if (BREAK_MAP == NULL) {
+		/* untouched pages of the map stay unallocated */
+		BREAK_MAP = calloc(TEXT_WORDS, 1);
+		if (BREAK_MAP == NULL) {
+			printf("Error: Can't allocate breakpoint map\n");
+			return;
+		}
+	}
+	BREAK_MAP[offset >> 2] = !BREAK_MAP[offset >> 2];
+	BREAK_COUNT += BREAK_MAP[offset >> 2] ? 1 : -1;
+	printf("Breakpoint %s at 0x%08x.\n\n", BREAK_MAP[offset >> 2] ? "set" : "cleared", address);
+}
+
+/***************************************************************/
+/* Toggle a watchpoint on a word; pages holding watched words  */
+/* are flagged so other accesses skip the watch list.          */
+/***************************************************************/
+void set_watchpoint(uint32_t address, int kind) {
+	int i;
+	address &= ~3;
+	if (WATCH_PAGES == NULL) {
+		WATCH_PAGES = calloc(1 << (32 - GUEST_PAGE_SHIFT), 1);
+		if (WATCH_PAGES == NULL) {
+			printf("Error: Can't allocate watchpoint map\n");
+			return;
+		}
+	}
+	for (i = 0; i < WATCH_COUNT; i++) {
+		if (WATCH_ADDR[i] == address && WATCH_KIND[i] == kind) {
+			break;
+		}
+	}
+	if (i < WATCH_COUNT) {
+		WATCH_COUNT--;
+		WATCH_ADDR[i] = WATCH_ADDR[WATCH_COUNT];
+		WATCH_KIND[i] = WATCH_KIND[WATCH_COUNT];
+		printf("Watchpoint cleared at 0x%08x.\n\n", address);
+	} else if (WATCH_COUNT == MAX_WATCHPOINTS) {
+		printf("Too many watchpoints (max %d).\n\n", MAX_WATCHPOINTS);
+		return;
+	} else {
+		WATCH_ADDR[WATCH_COUNT] = address;
+		WATCH_KIND[WATCH_COUNT++] = kind;
+		printf("Watchpoint (%s%s) set at 0x%08x.\n\n",
+			kind & WATCH_READ ? "r" : "", kind & WATCH_WRITE ? "w" : "", address);
+	}
+
+	/* rebuild the flags of the affected page */
+	WATCH_PAGES[address >> GUEST_PAGE_SHIFT] = 0;
+	for (i = 0; i < WATCH_COUNT; i++) {
+		if ((WATCH_ADDR[i] >> GUEST_PAGE_SHIFT) == (address >> GUEST_PAGE_SHIFT)) {
+			WATCH_PAGES[address >> GUEST_PAGE_SHIFT] |= WATCH_KIND[i];
+		}
+	}
+	/* with the last one gone, loads and stores stop looking at the map */
+	if (WATCH_COUNT == 0) {
+		free(WATCH_PAGES);
+		WATCH_PAGES = NULL;
+	}
+}
+
+/***************************************************************/
+/* Slow path for an access to a page with watchpoints          */
+/***************************************************************/
+void watch_check(uint32_t address, int kind, uint32_t value) {
+	int i;
+	for (i = 0; i < WATCH_COUNT; i++) {
+		if (WATCH_ADDR[i] == (address & ~3) && (WATCH_KIND[i] & kind)) {
+			if (kind == WATCH_WRITE) {
+				printf("Watchpoint (w) at 0x%08x: pc 0x%08x writes 0x%08x\n", address, CURRENT_STATE.PC, value);
+			} else {
+				printf("Watchpoint (r) at 0x%08x: pc 0x%08x reads 0x%08x\n", address, CURRENT_STATE.PC, mem_read_32(address));
+			}
+			DEBUG_HIT = TRUE;
+			return;
+		}
+	}
+}
+
+/***************************************************************/
+/* Start recording into an arena of the given size             */
+/***************************************************************/
+void undo_start(uint32_t megabytes) {
+	uint64_t bytes = (uint64_t) megabytes << 20;
+	undo_log_t *log;
+
+	undo_stop();
+	log = calloc(1, sizeof(undo_log_t));
+	log->cp_capacity = bytes / sizeof(undo_entry_t) / UNDO_CHECKPOINT_INTERVAL + 2;
+	if (bytes <= log->cp_capacity * sizeof(undo_checkpoint_t)) {
+		printf("Undo budget too small.\n\n");
+		free(log);
+		return;
+	}
+	log->capacity = (bytes - log->cp_capacity * sizeof(undo_checkpoint_t)) / sizeof(undo_entry_t);
+	log->arena = malloc(bytes);
+	if (log->arena == NULL) {
+		printf("Error: Can't allocate %u MB undo log\n", megabytes);
+		free(log);
+		return;
+	}
+	log->checkpoints = (undo_checkpoint_t *) log->arena;
+	log->entries = (undo_entry_t *) (log->arena + log->cp_capacity * sizeof(undo_checkpoint_t));
+	UNDO_LOG = log;
+	printf("Recording on (%u MB, last %llu instructions).\n\n", megabytes, (unsigned long long) log->capacity);
+}
+
+void undo_stop() {
+	if (UNDO_LOG) {
+		free(UNDO_LOG->arena);
+		free(UNDO_LOG);
+		UNDO_LOG = NULL;
+	}
+}
+
+/* forget the history, e.g. after the state was changed by hand */
+void undo_clear() {
+	if (UNDO_LOG) {
+		UNDO_LOG->head = UNDO_LOG->tail = 0;
+		UNDO_LOG->cp_head = UNDO_LOG->cp_tail = 0;
+	}
+}
+
+/***************************************************************/
+/* Log what the instruction about to execute will overwrite    */
+/***************************************************************/
+void undo_record(uint32_t instruction) {
+	undo_log_t *log = UNDO_LOG;
+	uint32_t rd = (instruction >> 7) & 31;
+
+	if (log->head % UNDO_CHECKPOINT_INTERVAL == 0) {
+		if (log->cp_head - log->cp_tail == log->cp_capacity) {
+			log->cp_tail++;
+		}
+		undo_checkpoint_t *cp = &log->checkpoints[log->cp_head++ % log->cp_capacity];
+		cp->seq = log->head;
+		cp->state = CURRENT_STATE;
+	}
+	/* branches and ecall don't write rd, restoring it is harmless */
+	uint32_t where = rd, old;
+	if ((instruction & 127) == 0b0100011) {
+		uint32_t immS = ((instruction >> 25) << 5) | rd;
+		where = CURRENT_STATE.REGS[(instruction >> 15) & 31] + sext_32(immS, 12);
+		if (where < RISCV_REGS) {
+			where = 0;	/* unmapped store, nothing to undo */
+		}
+	}
+	/* read before logging, a faulting store leaves no entry */
+	old = where < RISCV_REGS ? CURRENT_STATE.REGS[where] : mem_read_32(where);
+
+	if (log->head - log->tail == log->capacity) {
+		log->tail++;
+	}
+	undo_entry_t *e = &log->entries[log->head++ % log->capacity];
+	e->pc = CURRENT_STATE.PC;
+	e->where = where;
+	e->old = old;
+}
+
+/***************************************************************/
+/* Forget what undo_record() logged for an instruction that    */
+/* faulted: a faulting load is logged before it runs, and the  */
+/* checkpoint may have been taken for either.                  */
+/***************************************************************/
+void undo_unrecord() {
+	undo_log_t *log = UNDO_LOG;
+
+	if (log->head != log->tail && log->entries[(log->head - 1) % log->capacity].pc == CURRENT_STATE.PC) {
+		log->head--;
+	}
+	if (log->cp_head != log->cp_tail && log->checkpoints[(log->cp_head - 1) % log->cp_capacity].seq == log->head) {
+		log->cp_head--;
+	}
+}
+
+/**********************************************************************/
+/* Step backwards. A long rstep restores only memory down to the      */
+/* nearest checkpoint and takes the registers from it in one copy.    */
+/* rcontinue goes back until a breakpoint or a write watchpoint.      */
+/**********************************************************************/
+uint64_t undo_steps(uint64_t num_instructions, int stop_at_break) {
+	undo_log_t *log = UNDO_LOG;
+	undo_entry_t *e;
+	uint64_t s, c;
+
+	if (log == NULL) {
+		printf("Not recording, use record first.\n\n");
+		return 0;
+	}
+	if (num_instructions > log->head - log->tail) {
+		num_instructions = log->head - log->tail;
+	}
+	uint64_t target = log->head - num_instructions;
+	s = log->head;
+
+	if (!stop_at_break) {
+		for (c = log->cp_tail; c < log->cp_head; c++) {
+			undo_checkpoint_t *cp = &log->checkpoints[c % log->cp_capacity];
+			if (cp->seq >= target && cp->seq < s) {
+				while (s > cp->seq) {
+					e = &log->entries[--s % log->capacity];
+					if (e->where >= RISCV_REGS) {
+						mem_write_32(e->where, e->old);
+					}
+					OPCODE_COUNT[mem_peek_32(e->pc) & 127]--;
+				}
+				CURRENT_STATE = cp->state;
+				break;
+			}
+		}
+	}
+
+	while (s > target) {
+		e = &log->entries[--s % log->capacity];
+		if (e->where < RISCV_REGS) {
+			CURRENT_STATE.REGS[e->where] = e->old;
+		} else {
+			mem_write_32(e->where, e->old);
+		}
+		CURRENT_STATE.PC = e->pc;
+		/* the text is not written by the program, so this is the word that ran */
+		OPCODE_COUNT[mem_peek_32(e->pc) & 127]--;
+		if (!stop_at_break) {
+			continue;
+		}
+		uint32_t offset = e->pc - MEM_TEXT_BEGIN;
+		if (BREAK_MAP && offset < TEXT_WORDS * 4 && BREAK_MAP[offset >> 2]) {
+			printf("Breakpoint at 0x%08x\n", e->pc);
+			BREAK_STOPPED = TRUE;
+			BREAK_STOP_PC = e->pc;
+			break;
+		}
+		if (e->where >= RISCV_REGS && WATCH_PAGES && (WATCH_PAGES[e->where >> GUEST_PAGE_SHIFT] & WATCH_WRITE)) {
+			int i;
+			for (i = 0; i < WATCH_COUNT && !(WATCH_ADDR[i] == (e->where & ~3) && (WATCH_KIND[i] & WATCH_WRITE)); i++);
+			if (i < WATCH_COUNT) {
+				printf("Watchpoint (w) at 0x%08x: pc 0x%08x wrote it\n", e->where, e->pc);
+				break;
+			}
+		}
+	}
+
+	uint64_t undone = log->head - s;
+	log->head = s;
+	while (log->cp_head > log->cp_tail && log->checkpoints[(log->cp_head - 1) % log->cp_capacity].seq >= s) {
+		log->cp_head--;
+	}
+	INSTRUCTION_COUNT -= undone;
+	NEXT_STATE = CURRENT_STATE;
+	RUN_FLAG = TRUE;
+	return undone;
+}
+
+/***************************************************************/
+/* Start/stop the heatmap. Counters are only allocated for     */
+/* pages as they are first touched.                            */
+/***************************************************************/
+void heat_start() {
+	heat_map_t *h;
+
+	heat_stop();
+	h = calloc(1, sizeof(heat_map_t));
+	h->epoch_capacity = 64;
+	h->ws_pages = calloc(h->epoch_capacity, sizeof(uint32_t));
+	h->ws_lines = calloc(h->epoch_capacity, sizeof(uint32_t));
+	h->stride_capacity = 1024;
+	h->strides = calloc(h->stride_capacity, sizeof(heat_stride_t));
+	if (h->ws_pages == NULL || h->ws_lines == NULL || h->strides == NULL) {
+		printf("Error: Can't allocate heatmap\n");
+		HEAT_MAP = h;
+		heat_stop();
+		return;
+	}
+	HEAT_MAP = h;
+}
+
+void heat_stop() {
+	heat_map_t *h = HEAT_MAP;
+	uint32_t i, j;
+	if (h == NULL) {
+		return;
+	}
+	HEAT_MAP = NULL;
+	for (i = 0; i < sizeof(h->dir) / sizeof(h->dir[0]); i++) {
+		if (h->dir[i]) {
+			for (j = 0; j < (1 << HEAT_DIR_BITS); j++) {
+				free(h->dir[i][j]);
+			}
+			free(h->dir[i]);
+		}
+	}
+	free(h->ws_pages);
+	free(h->ws_lines);
+	free(h->strides);
+	free(h);
+}
+
+/* start over with the same settings, e.g. on reset */
+void heat_clear() {
+	if (HEAT_MAP) {
+		heat_start();
+	}
+}
+
+/* count one access to a line, and the line/page in this epoch's working set */
+static void heat_touch(heat_map_t *h, uint32_t address, int class, int kind) {
+	uint32_t page = address >> GUEST_PAGE_SHIFT;
+	uint32_t line = (address >> HEAT_LINE_SHIFT) & (HEAT_LINES - 1);
+	heat_page_t **table = h->dir[page >> HEAT_DIR_BITS];
+	heat_page_t *p;
+
+	if (table == NULL) {
+		table = h->dir[page >> HEAT_DIR_BITS] = calloc(1 << HEAT_DIR_BITS, sizeof(heat_page_t *));
+		if (table == NULL) {
+			return;
+		}
+	}
+	p = table[page & ((1 << HEAT_DIR_BITS) - 1)];
+	if (p == NULL) {
+		p = table[page & ((1 << HEAT_DIR_BITS) - 1)] = calloc(1, sizeof(heat_page_t));
+		if (p == NULL) {
+			return;
+		}
+		p->epoch = UINT32_MAX;
+		h->pages++;
+	}
+	p->count[line]++;
+	if (p->epoch != h->epoch) {
+		p->epoch = h->epoch;
+		p->epoch_lines = 0;
+		h->ws_pages[h->epoch]++;
+	}
+	if (!(p->epoch_lines & (1ULL << line))) {
+		p->epoch_lines |= 1ULL << line;
+		h->ws_lines[h->epoch]++;
+	}
+	h->split[class][kind]++;
+}
+
+void heat_fetch(uint32_t pc) {
+	heat_map_t *h = HEAT_MAP;
+	if (h->instructions && h->instructions % HEAT_EPOCH == 0) {
+		if (h->epoch + 1 == h->epoch_capacity) {
+			uint32_t *pages = realloc(h->ws_pages, 2 * h->epoch_capacity * sizeof(uint32_t));
+			uint32_t *lines = pages ? realloc(h->ws_lines, 2 * h->epoch_capacity * sizeof(uint32_t)) : NULL;
+			if (pages) {
+				h->ws_pages = pages;
+			}
+			if (lines) {
+				h->ws_lines = lines;
+				memset(pages + h->epoch_capacity, 0, h->epoch_capacity * sizeof(uint32_t));
+				memset(lines + h->epoch_capacity, 0, h->epoch_capacity * sizeof(uint32_t));
+				h->epoch_capacity *= 2;
+			}
+		}
+		/* without room the last epoch keeps growing */
+		if (h->epoch + 1 < h->epoch_capacity) {
+			h->epoch++;
+		}
+	}
+	h->instructions++;
+	heat_touch(h, pc, HEAT_TEXT, HEAT_FETCH);
+}
+
+/* the stride entry of a load PC, the table doubles at half full */
+static heat_stride_t *heat_stride_entry(heat_map_t *h, uint32_t pc) {
+	uint32_t mask = h->stride_capacity - 1, i;
+
+	if (2 * (h->stride_used + 1) > h->stride_capacity) {
+		heat_stride_t *old = h->strides;
+		uint32_t old_capacity = h->stride_capacity;
+		heat_stride_t *grown = calloc(2 * old_capacity, sizeof(heat_stride_t));
+		if (grown) {
+			h->strides = grown;
+			h->stride_capacity *= 2;
+			mask = h->stride_capacity - 1;
+			for (i = 0; i < old_capacity; i++) {
+				if (old[i].pc) {
+					uint32_t j = (old[i].pc >> 2) & mask;
+					while (grown[j].pc) {
+						j = (j + 1) & mask;
+					}
+					grown[j] = old[i];
+				}
+			}
+			free(old);
+		} else if (h->stride_used + 1 >= h->stride_capacity) {
+			return NULL;
+		}
+	}
+	for (i = (pc >> 2) & mask; h->strides[i].pc && h->strides[i].pc != pc; i = (i + 1) & mask);
+	if (h->strides[i].pc == 0) {
+		h->strides[i].pc = pc;
+		h->stride_used++;
+	}
+	return &h->strides[i];
+}
+
+/* a load or store; sp-based accesses are counted as stack */
+void heat_access(uint32_t address, uint32_t pc, uint32_t base_reg, int kind) {
+	heat_map_t *h = HEAT_MAP;
+	int class = address < MEM_DATA_BEGIN ? HEAT_TEXT : base_reg == 2 ? HEAT_STACK : HEAT_DATA;
+
+	heat_touch(h, address, class, kind);
+	if (kind == HEAT_READ) {
+		heat_stride_t *e = heat_stride_entry(h, pc);
+		if (e == NULL) {
+			return;
+		}
+		if (e->count) {
+			int32_t stride = address - e->last;
+			if (e->count > 1 && stride == e->stride) {
+				e->repeats++;
+			}
+			e->stride = stride;
+		}
+		e->last = address;
+		e->count++;
+	}
+}
+
+/* the fetch and the load or store of the instruction cycle() is about to run */
+void heat_instruction() {
+	instruction_t d;
+	uint32_t pc = CURRENT_STATE.PC;
+
+	decode_instruction(mem_read_32(pc), &d);
+	heat_fetch(pc);
+	if (d.opcode == 0b0000011) {
+		heat_access(CURRENT_STATE.REGS[d.rs1] + d.immI, pc, d.rs1, HEAT_READ);
+	} else if (d.opcode == 0b0100011) {
+		heat_access(CURRENT_STATE.REGS[d.rs1] + d.immS, pc, d.rs1, HEAT_WRITE);
+	}
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                               */
+/* Report the heatmap: access split, working set per epoch,    */
+/* hottest lines and the strides of the busiest loads.         */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
-{
-	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+void print_heatmap() {
+	static const char *classes[3] = { "text", "data", "stack" };
+	heat_map_t *h = HEAT_MAP;
+	uint32_t top_address[HEAT_TOP], top_count[HEAT_TOP];
+	heat_stride_t *top_loads[HEAT_TOP];
+	uint32_t num_top = 0, num_loads = 0, i, j, k, line;
+	uint64_t total = 0;
+	out_buf_t out;
+
+	if (h == NULL) {
+		return;
+	}
+	out_init(&out, STDOUT_FILENO);
+	out_printf(&out, "Heatmap: %llu instructions, %u pages touched (%llu KB of counters)\n",
+		(unsigned long long) h->instructions, h->pages,
+		(unsigned long long) (h->pages * sizeof(heat_page_t)) >> 10);
+
+	out_printf(&out, "\n%-24s %12s %12s %12s\n", "", "fetch", "read", "write");
+	for (i = 0; i < 3; i++) {
+		out_printf(&out, "%-24s %12llu %12llu %12llu\n", i == HEAT_STACK ? "stack (sp-based)" : classes[i],
+			(unsigned long long) h->split[i][HEAT_FETCH], (unsigned long long) h->split[i][HEAT_READ],
+			(unsigned long long) h->split[i][HEAT_WRITE]);
+		total += h->split[i][HEAT_FETCH] + h->split[i][HEAT_READ] + h->split[i][HEAT_WRITE];
+	}
+
+	/* working set, adjacent epochs merged (largest shown) to keep it to HEAT_TOP rows */
+	uint32_t epochs = h->instructions ? h->epoch + 1 : 0;
+	uint32_t per_row = (epochs + HEAT_TOP - 1) / HEAT_TOP;
+	out_printf(&out, "\nWorking set per %d instructions%s:\n%-28s %8s %8s\n", HEAT_EPOCH,
+		per_row > 1 ? " (largest of each range)" : "", "instructions", "pages", "lines");
+	for (i = 0; i < epochs; i += per_row) {
+		uint32_t pages = 0, lines = 0;
+		for (j = i; j < i + per_row && j < epochs; j++) {
+			pages = h->ws_pages[j] > pages ? h->ws_pages[j] : pages;
+			lines = h->ws_lines[j] > lines ? h->ws_lines[j] : lines;
+		}
+		uint64_t last = (uint64_t) j * HEAT_EPOCH < h->instructions ? (uint64_t) j * HEAT_EPOCH : h->instructions;
+		out_printf(&out, "%12llu - %-13llu %8u %8u\n", (unsigned long long) i * HEAT_EPOCH,
+			(unsigned long long) last, pages, lines);
+	}
+
+	/* hottest lines, kept sorted by insertion */
+	for (i = 0; i < sizeof(h->dir) / sizeof(h->dir[0]); i++) {
+		if (h->dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < (1 << HEAT_DIR_BITS); j++) {
+			heat_page_t *p = h->dir[i][j];
+			if (p == NULL) {
+				continue;
+			}
+			for (line = 0; line < HEAT_LINES; line++) {
+				uint32_t count = p->count[line];
+				if (count == 0 || (num_top == HEAT_TOP && count <= top_count[HEAT_TOP - 1])) {
+					continue;
+				}
+				k = num_top < HEAT_TOP ? num_top++ : HEAT_TOP - 1;
+				for (; k > 0 && top_count[k - 1] < count; k--) {
+					top_count[k] = top_count[k - 1];
+					top_address[k] = top_address[k - 1];
+				}
+				top_count[k] = count;
+				top_address[k] = (((i << HEAT_DIR_BITS) | j) << GUEST_PAGE_SHIFT) | (line << HEAT_LINE_SHIFT);
+			}
+		}
+	}
+	out_printf(&out, "\nHottest %d-byte lines:\n", 1 << HEAT_LINE_SHIFT);
+	for (i = 0; i < num_top; i++) {
+		out_printf(&out, "0x%08x %12u %6.2f%% %s\n", top_address[i], top_count[i],
+			100.0 * top_count[i] / total, top_address[i] < MEM_DATA_BEGIN ? "text" : "data");
+	}
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+	/* busiest loads and how regular their addresses are */
+	for (i = 0; i < h->stride_capacity; i++) {
+		heat_stride_t *e = &h->strides[i];
+		if (e->pc == 0 || (num_loads == HEAT_TOP && e->count <= top_loads[HEAT_TOP - 1]->count)) {
+			continue;
+		}
+		k = num_loads < HEAT_TOP ? num_loads++ : HEAT_TOP - 1;
+		for (; k > 0 && top_loads[k - 1]->count < e->count; k--) {
+			top_loads[k] = top_loads[k - 1];
 		}
+		top_loads[k] = e;
 	}
+	out_printf(&out, "\nLoad strides:\n%-10s %12s %10s %8s\n", "pc", "loads", "stride", "repeats");
+	for (i = 0; i < num_loads; i++) {
+		heat_stride_t *e = top_loads[i];
+		out_printf(&out, "0x%08x %12u %10d %7.1f%%\n", e->pc, e->count, e->stride,
+			e->count > 2 ? 100.0 * e->repeats / (e->count - 2) : 0.0);
+	}
+	out_str(&out, "\n");
+	out_free(&out);
 }
 
 /***************************************************************/
-/* Execute one cycle                                           */
+/* Called by the worker between blocks. Parks while the REPL   */
+/* holds a pause, returns TRUE once a stop has been requested. */
 /***************************************************************/
-void cycle() {                                                
-	handle_instruction();
-	CURRENT_STATE = NEXT_STATE;
-	INSTRUCTION_COUNT++;
+int sim_poll() {
+	int flags = atomic_load_explicit(&SIM_INTERRUPT, memory_order_relaxed);
+	if (flags == 0) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&SIM_LOCK);
+	while (atomic_load(&SIM_INTERRUPT) == SIM_PAUSE) {
+		SIM_PAUSED = TRUE;
+		pthread_cond_broadcast(&SIM_COND);
+		pthread_cond_wait(&SIM_COND, &SIM_LOCK);
+	}
+	SIM_PAUSED = FALSE;
+	pthread_mutex_unlock(&SIM_LOCK);
+	return (atomic_load(&SIM_INTERRUPT) & SIM_STOP) != 0;
+}
+
+static void *sim_thread(void *arg) {
+	switch (SIM_JOB.command) {
+		case 's':
+			runAll();
+			break;
+		case 'r':
+			run(SIM_JOB.arg1);
+			break;
+		case 'a':
+			sample(SIM_JOB.arg1, SIM_JOB.arg2);
+			break;
+	}
+	pthread_mutex_lock(&SIM_LOCK);
+	SIM_ACTIVE = FALSE;
+	pthread_cond_broadcast(&SIM_COND);
+	pthread_mutex_unlock(&SIM_LOCK);
+	return NULL;
 }
 
 /***************************************************************/
-/* Simulate RISC-V for n cycles                                */
+/* Start sim/run/sample on the worker thread. When commands    */
+/* come from a script, wait for it so they stay in order.      */
 /***************************************************************/
-void run(int num_cycles) {                                      
-	
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped\n\n");
+void sim_start(char command, uint32_t arg1, uint32_t arg2) {
+	pthread_mutex_lock(&SIM_LOCK);
+	if (SIM_ACTIVE) {
+		pthread_mutex_unlock(&SIM_LOCK);
+		printf("Simulation already running, use stop first.\n\n");
 		return;
 	}
+	pthread_mutex_unlock(&SIM_LOCK);
+	sim_wait();
+
+	SIM_JOB.command = command;
+	SIM_JOB.arg1 = arg1;
+	SIM_JOB.arg2 = arg2;
+	DEBUG_HIT = FALSE;
+	/* resume past the breakpoint we stopped on, a fresh run stops on it */
+	STEP_OVER = BREAK_STOPPED && BREAK_STOP_PC == CURRENT_STATE.PC;
+	BREAK_STOPPED = FALSE;
+	atomic_store(&SIM_INTERRUPT, 0);
+	SIM_ACTIVE = TRUE;
+	if (pthread_create(&SIM_THREAD, NULL, sim_thread, NULL) != 0) {
+		SIM_ACTIVE = FALSE;
+		printf("Error: Can't start simulation thread\n");
+		return;
+	}
+	SIM_JOINABLE = TRUE;
+	if (!isatty(STDIN_FILENO)) {
+		sim_wait();
+	}
+}
 
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
+/***************************************************************/
+/* Park the worker at a block boundary so the REPL can read or */
+/* change a consistent state, then let it continue.            */
+/***************************************************************/
+void sim_pause() {
+	pthread_mutex_lock(&SIM_LOCK);
+	if (SIM_ACTIVE) {
+		atomic_fetch_or(&SIM_INTERRUPT, SIM_PAUSE);
+		while (SIM_ACTIVE && !SIM_PAUSED) {
+			pthread_cond_wait(&SIM_COND, &SIM_LOCK);
 		}
-		cycle();
 	}
+	pthread_mutex_unlock(&SIM_LOCK);
+}
+
+void sim_resume() {
+	pthread_mutex_lock(&SIM_LOCK);
+	atomic_fetch_and(&SIM_INTERRUPT, ~SIM_PAUSE);
+	pthread_cond_broadcast(&SIM_COND);
+	pthread_mutex_unlock(&SIM_LOCK);
+}
+
+void sim_stop() {
+	pthread_mutex_lock(&SIM_LOCK);
+	atomic_fetch_or(&SIM_INTERRUPT, SIM_STOP);
+	pthread_cond_broadcast(&SIM_COND);
+	pthread_mutex_unlock(&SIM_LOCK);
+}
+
+/* wait for the current job, if any, to end */
+void sim_wait() {
+	if (SIM_JOINABLE) {
+		pthread_join(SIM_THREAD, NULL);
+		SIM_JOINABLE = FALSE;
+	}
+}
+
+/* Ctrl-C pauses the guest instead of killing the simulator */
+static void sigint_handler(int signo) {
+	atomic_fetch_or(&SIM_INTERRUPT, SIM_STOP);
 }
 
 /***************************************************************/
-/* simulate to completion                                      */
+/* Monotonic wall clock in seconds                             */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped.\n\n");
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***************************************************************/
+/* Count guest pages the program (or loader) has written, from */
+/* WRITTEN_PAGES rather than host residency, which THP and     */
+/* swapping would skew.                                        */
+/***************************************************************/
+uint32_t count_written_pages() {
+	uint32_t written = 0, i;
+	for (i = 0; i < sizeof(WRITTEN_PAGES); i++) {
+		written += __builtin_popcount(WRITTEN_PAGES[i]);
+	}
+	return written;
+}
+
+/***************************************************************/
+/* Emit run statistics as a single line of JSON                */
+/***************************************************************/
+void print_stats() {
+	struct rusage usage;
+	uint64_t instructions = harts_instructions();
+	uint64_t counts[128];
+
+	/* loads, stores and branches are derived from the opcode counters */
+	harts_opcode_count(counts);
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(STATS_FILE, "{\"instructions\": %llu, \"wall_time_s\": %.6f, \"mips\": %.3f, "
+		"\"load_time_s\": %.6f, \"pages_written\": %u, \"peak_rss_kb\": %ld, "
+		"\"loads\": %llu, \"stores\": %llu, \"branches\": %llu}\n",
+		(unsigned long long) instructions, STATS.run_time,
+		STATS.run_time > 0 ? instructions / STATS.run_time / 1e6 : 0.0,
+		STATS.load_time, count_written_pages(), usage.ru_maxrss,
+		(unsigned long long) counts[0b0000011],
+		(unsigned long long) counts[0b0100011],
+		(unsigned long long) counts[0b1100011]);
+	fflush(STATS_FILE);
+}
+
+/***************************************************************/
+/* Buffered output shared by the dump commands. Text is built  */
+/* in a large buffer and handed to the kernel in one write().  */
+/* With fd < 0 the caller's buffer is filled and never flushed */
+/***************************************************************/
+#define OUT_BUF_SIZE (1 << 20)
+
+/* two hex characters per byte value */
+static char HEX_BYTE[256][2];
+
+void out_init(out_buf_t *out, int fd) {
+	if (HEX_BYTE[0][0] == 0) {
+		static const char digits[] = "0123456789abcdef";
+		int i;
+		for (i = 0; i < 256; i++) {
+			HEX_BYTE[i][0] = digits[i >> 4];
+			HEX_BYTE[i][1] = digits[i & 15];
+		}
+	}
+	out->data = malloc(OUT_BUF_SIZE);
+	out->len = 0;
+	out->size = out->data ? OUT_BUF_SIZE : 0;
+	out->fd = fd;
+}
+
+void out_flush(out_buf_t *out) {
+	size_t done = 0;
+	if (out->fd < 0) {
 		return;
 	}
+	fflush(stdout);	/* keep order with printf output */
+	while (done < out->len) {
+		ssize_t n = write(out->fd, out->data + done, out->len - done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	out->len = 0;
+}
+
+void out_free(out_buf_t *out) {
+	out_flush(out);
+	free(out->data);
+	out->data = NULL;
+}
+
+/* make room for n more bytes, FALSE if they don't fit */
+static int out_reserve(out_buf_t *out, size_t n) {
+	if (out->len + n > out->size) {
+		out_flush(out);
+	}
+	return out->len + n <= out->size;
+}
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+void out_str(out_buf_t *out, const char *s) {
+	size_t n = strlen(s);
+	if (out_reserve(out, n)) {
+		memcpy(out->data + out->len, s, n);
+		out->len += n;
+	}
+}
+
+void out_hex32(out_buf_t *out, uint32_t value) {
+	if (out_reserve(out, 8)) {
+		char *p = out->data + out->len;
+		memcpy(p + 0, HEX_BYTE[(value >> 24) & 0xFF], 2);
+		memcpy(p + 2, HEX_BYTE[(value >> 16) & 0xFF], 2);
+		memcpy(p + 4, HEX_BYTE[(value >>  8) & 0xFF], 2);
+		memcpy(p + 6, HEX_BYTE[(value >>  0) & 0xFF], 2);
+		out->len += 8;
+	}
+}
+
+void out_dec(out_buf_t *out, int64_t value) {
+	char digits[24];
+	int n = 0;
+	uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (value < 0) {
+		digits[n++] = '-';
+	}
+	if (out_reserve(out, n)) {
+		while (n) {
+			out->data[out->len++] = digits[--n];
+		}
+	}
+}
+
+void out_printf(out_buf_t *out, const char *format, ...) {
+	va_list args;
+	int n;
+	va_start(args, format);
+	n = vsnprintf(out->data + out->len, out->size - out->len, format, args);
+	va_end(args);
+	if (n < 0) {
+		return;
+	}
+	if (out->len + n >= out->size) {
+		/* didn't fit, retry in the flushed buffer */
+		if (!out_reserve(out, n + 1)) {
+			return;
+		}
+		va_start(args, format);
+		n = vsnprintf(out->data + out->len, out->size - out->len, format, args);
+		va_end(args);
+	}
+	out->len += n;
+}
+
+/***************************************************************/
+/* Host address of a guest address, NULL if it isn't mapped.   */
+/* *avail (if given) gets the bytes left in its region.        */
+/***************************************************************/
+uint8_t *guest_to_host(uint32_t address, uint64_t *avail) {
+	int i;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if (address >= MEM_REGIONS[i].begin && address <= MEM_REGIONS[i].end) {
+			if (avail) {
+				*avail = (uint64_t) MEM_REGIONS[i].end - address + 1;
+			}
+			return MEM_REGIONS[i].mem + (address - MEM_REGIONS[i].begin);
+		}
 	}
-	printf("Simulation Finished.\n\n");
+	return NULL;
+}
+
+/* TRUE if the guest page holding an address has been written since reset */
+int guest_page_written(uint32_t address) {
+	return PAGE_WRITTEN(address) && guest_to_host(address, NULL) != NULL;
 }
 
 /**************************************************************************************/ 
 /* Dump region of memory to the terminal (make sure provided address is word aligned) */
 /**************************************************************************************/
 void mdump(uint32_t start, uint32_t stop) {          
-	uint32_t address;
-
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	uint64_t address, page_end = 0;
+	int written = FALSE;
+	out_buf_t out;
+
+	out_init(&out, STDOUT_FILENO);
+	out_str(&out, "-------------------------------------------------------------\n");
+	out_str(&out, "Memory content [0x");
+	out_hex32(&out, start);
+	out_str(&out, "..0x");
+	out_hex32(&out, stop);
+	out_str(&out, "] :\n");
+	out_str(&out, "-------------------------------------------------------------\n");
+	out_str(&out, "\t[Address in Hex (Dec) ]\t[Value]\n");
 	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+		/* one lookup per page */
+		if (address >= page_end) {
+			page_end = ((address >> GUEST_PAGE_SHIFT) + 1) << GUEST_PAGE_SHIFT;
+			written = guest_page_written(address);
+		}
+		if (!written) {
+			/* collapse the run of unwritten pages to one line */
+			uint64_t last = address;
+			while (TRUE) {
+				/* last word of this page, or of the dump */
+				uint64_t next_page = ((last >> GUEST_PAGE_SHIFT) + 1) << GUEST_PAGE_SHIFT;
+				uint64_t page_last = last + ((next_page - 1 - last) & ~3ULL);
+				if (page_last >= stop) {
+					last += (stop - last) & ~3ULL;
+					break;
+				}
+				if (guest_page_written(page_last + 4)) {
+					last = page_last;
+					break;
+				}
+				last = page_last + 4;
+			}
+			out_str(&out, "\t0x");
+			out_hex32(&out, address);
+			out_str(&out, "..0x");
+			out_hex32(&out, last);
+			out_str(&out, " :\tunwritten (zero)\n");
+			address = last;
+			page_end = 0;
+			continue;
+		}
+		uint8_t *host = guest_to_host(address, NULL);
+		out_str(&out, "\t0x");
+		out_hex32(&out, address);
+		out_str(&out, " (");
+		out_dec(&out, (int32_t) address);
+		out_str(&out, ") :\t0x");
+		out_hex32(&out, host[0] | (host[1] << 8) | (host[2] << 16) | ((uint32_t) host[3] << 24));
+		out_str(&out, "\n");
 	}
-	printf("\n");
+	out_str(&out, "\n");
+	out_free(&out);
+}
+
+/***************************************************************/
+/* Write guest memory [start..stop+3] to a file as raw bytes.  */
+/* Unwritten pages are left as holes in a sparse file.         */
+/***************************************************************/
+void mdump_raw(const char *file, uint32_t start, uint32_t stop) {
+	uint64_t address, end = (uint64_t) stop + 4;
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		printf("Error: Can't open dump file %s\n", file);
+		return;
+	}
+	for (address = start; address < end; ) {
+		uint64_t page_end = ((address >> GUEST_PAGE_SHIFT) + 1) << GUEST_PAGE_SHIFT;
+		uint64_t chunk = (page_end < end ? page_end : end) - address;
+		uint64_t avail;
+		uint8_t *host = guest_to_host(address, &avail);
+		/* don't run past the end of a region */
+		if (host && chunk > avail) {
+			chunk = avail;
+		}
+		if (host && guest_page_written(address)) {
+			if (pwrite(fd, host, chunk, address - start) != (ssize_t) chunk) {
+				printf("Error: Can't write dump file %s\n", file);
+				break;
+			}
+		}
+		address += chunk;
+	}
+	if (ftruncate(fd, end - start) != 0) {
+		printf("Error: Can't write dump file %s\n", file);
+	}
+	close(fd);
+	printf("Wrote %llu bytes [0x%08x..0x%08x] to %s\n\n", (unsigned long long)(end - start), start, stop + 3, file);
 }
 
 /***************************************************************/
@@ -128,19 +1685,31 @@ void mdump(uint32_t start, uint32_t stop) {
 /***************************************************************/
 void rdump() {                               
 	int i; 
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
+	out_buf_t out;
+
+	out_init(&out, STDOUT_FILENO);
+	out_str(&out, "-------------------------------------\n");
+	out_str(&out, "Dumping Register Content\n");
+	out_str(&out, "-------------------------------------\n");
+	if (HART_COUNT > 1) {
+		out_printf(&out, "Hart\t: %u of %u\n", HART->hartid, HART_COUNT);
+	}
+	out_str(&out, "# Instructions Executed\t: ");
+	out_dec(&out, INSTRUCTION_COUNT);
+	out_str(&out, "\nPC\t: 0x");
+	out_hex32(&out, CURRENT_STATE.PC);
+	out_str(&out, "\n-------------------------------------\n");
+	out_str(&out, "[Register]\t[Value]\n");
+	out_str(&out, "-------------------------------------\n");
 	for (i = 0; i < RISCV_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+		out_str(&out, "[R");
+		out_dec(&out, i);
+		out_str(&out, "]\t: 0x");
+		out_hex32(&out, CURRENT_STATE.REGS[i]);
+		out_str(&out, "\n");
 	}
-	printf("-------------------------------------\n");
-	
+	out_str(&out, "-------------------------------------\n");
+	out_free(&out);
 }
 
 /***************************************************************/
@@ -154,27 +1723,107 @@ void handle_command() {
 
 	printf("OZU-RISCV SIM:> ");
 
-	if (scanf("%s", buffer) == EOF){
+	if (scanf("%19s", buffer) == EOF){
+		sim_wait();
 		exit(0);
 	}
 
 	switch(buffer[0]) {
 		case 'S':
 		case 's':
-			runAll(); 
+			if (buffer[1] == 'a' || buffer[1] == 'A'){
+				if (scanf("%u %u", &start, &stop) != 2){
+					break;
+				}
+				sim_start('a', start, stop);
+			}else if (buffer[1] == 't' || buffer[1] == 'T'){
+				sim_stop();
+				sim_wait();
+			}else {
+				sim_start('s', 0, 0);
+			}
+			break;
+		case 'B':
+		case 'b':
+			if (scanf("%x", &start) != 1){
+				break;
+			}
+			sim_pause();
+			set_breakpoint(start);
+			sim_resume();
+			break;
+		case 'W':
+		case 'w':
+			if (scanf("%x", &start) != 1){
+				break;
+			}
+			/* optional r, w or rw; defaults to w */
+			if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
+				buffer[0] = '\0';
+			}
+			stop = (strchr(buffer, 'r') ? WATCH_READ : 0) | (strchr(buffer, 'w') ? WATCH_WRITE : 0);
+			sim_pause();
+			set_watchpoint(start, stop ? stop : WATCH_WRITE);
+			sim_resume();
+			break;
+		case 'T':
+		case 't':
+			TRACE_FLAG = !TRACE_FLAG;
+			printf("Tracing %s.\n", TRACE_FLAG ? "on" : "off");
 			break;
 		case 'M':
 		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
+			/* mdump [--raw <file>] <start> <stop> */
+			if (scanf("%19s", buffer) != 1){
+				break;
+			}
+			if (strcmp(buffer, "--raw") == 0) {
+				char file[256];
+				if (scanf("%255s %x %x", file, &start, &stop) != 3){
+					break;
+				}
+				sim_pause();
+				mdump_raw(file, start, stop);
+				sim_resume();
+				break;
+			}
+			if (sscanf(buffer, "%x", &start) != 1 || scanf("%x", &stop) != 1){
 				break;
 			}
+			sim_pause();
 			mdump(start, stop);
+			sim_resume();
+			break;
+		case 'H':
+		case 'h':
+			if (buffer[1] == 'a' || buffer[1] == 'A'){
+				/* hart <n>: the hart rdump and input work on */
+				if (scanf("%u", &register_no) != 1 || register_no >= HART_COUNT){
+					printf("There are %u harts.\n\n", HART_COUNT);
+					break;
+				}
+				HART = &HARTS[register_no];
+				printf("Showing hart %u.\n\n", register_no);
+				break;
+			}
+			sim_stop();
+			sim_wait();
+			if (HEAT_MAP) {
+				print_heatmap();
+				heat_stop();
+				printf("Heatmap off.\n\n");
+			} else {
+				heat_start();
+				printf("Heatmap on.\n\n");
+			}
 			break;
 		case '?':
 			help();
 			break;
 		case 'Q':
 		case 'q':
+			sim_stop();
+			sim_wait();
 			printf("**************************\n");
 			printf("Exiting OZU-RISCV! Good Bye...\n");
 			printf("**************************\n");
@@ -182,15 +1831,49 @@ void handle_command() {
 		case 'R':
 		case 'r':
 			if (buffer[1] == 'd' || buffer[1] == 'D'){
+				sim_pause();
 				rdump();
+				sim_resume();
+			}else if((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[2] == 'c' || buffer[2] == 'C')){
+				/* record [<MB>], without a budget it toggles */
+				if (fgets(buffer, sizeof(buffer), stdin) == NULL || sscanf(buffer, "%u", &cycles) != 1) {
+					cycles = UNDO_LOG ? 0 : UNDO_DEFAULT_MB;
+				}
+				sim_stop();
+				sim_wait();
+				if (cycles) {
+					undo_start(cycles);
+				} else {
+					undo_stop();
+					printf("Recording off.\n\n");
+				}
+			}else if(buffer[1] == 's' || buffer[1] == 'S'){
+				if (scanf("%u", &cycles) != 1) {
+					break;
+				}
+				sim_stop();
+				sim_wait();
+				stop = undo_steps(cycles, FALSE);
+				if (UNDO_LOG) {
+					printf("Stepped back %u instructions to 0x%08x.\n\n", stop, CURRENT_STATE.PC);
+				}
+			}else if(buffer[1] == 'c' || buffer[1] == 'C'){
+				sim_stop();
+				sim_wait();
+				stop = undo_steps(UINT64_MAX, TRUE);
+				if (UNDO_LOG) {
+					printf("Stepped back %u instructions to 0x%08x.\n\n", stop, CURRENT_STATE.PC);
+				}
 			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
+				sim_stop();
+				sim_wait();
 				reset();
 			}
 			else {
 				if (scanf("%d", &cycles) != 1) {
 					break;
 				}
-				run(cycles);
+				sim_start('r', cycles, 0);
 			}
 			break;
 		case 'I':
@@ -198,12 +1881,17 @@ void handle_command() {
 			if (scanf("%u %i", &register_no, &register_value) != 2){
 				break;
 			}
+			sim_pause();
 			CURRENT_STATE.REGS[register_no] = register_value;
 			NEXT_STATE.REGS[register_no] = register_value;
+			undo_clear();
+			sim_resume();
 			break;
 		case 'P':
 		case 'p':
+			sim_pause();
 			print_program(); 
+			sim_resume();
 			break;
 		default:
 			printf("Invalid Command.\n");
@@ -216,24 +1904,28 @@ void handle_command() {
 /***************************************************************/
 void reset() {   
 	int i;
-	/*reset registers*/
-	for (i = 0; i < RISCV_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
-	}
 	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+	/*give the touched pages back, fresh memory is already zero*/
+	if (GUEST_BASE) {
+		madvise(GUEST_BASE + MEM_TEXT_BEGIN, (uint64_t) MEM_DATA_END + 1 - MEM_TEXT_BEGIN, MADV_DONTNEED);
+	} else {
+		for (i = 0; i < NUM_MEM_REGION; i++) {
+			free(MEM_REGIONS[i].mem);
+		}
+		init_memory();
 	}
+	memset(&STATS, 0, sizeof(STATS));
+	memset(WRITTEN_PAGES, 0, sizeof(WRITTEN_PAGES));
+	LAST_WRITTEN_PAGE = UINT32_MAX;
 	
 	/*load program*/
 	load_program();
+	undo_clear();
+	heat_clear();
+	BREAK_STOPPED = FALSE;
 	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	/*reset registers and PC of every hart*/
+	init_harts();
 }
 
 /***************************************************************/
@@ -241,10 +1933,18 @@ void reset() {
 /***************************************************************/
 void init_memory() {                                           
 	int i;
+	if (MMAP_FLAG) {
+		init_guest_space();
+		return;
+	}
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+		/* calloc maps zero pages lazily, so untouched memory costs nothing */
+		MEM_REGIONS[i].mem = calloc(1, region_size);
+		if (MEM_REGIONS[i].mem == NULL) {
+			printf("Error: Can't allocate guest memory region %d\n", i);
+			exit(-1);
+		}
 	}
 }
 
@@ -255,6 +1955,7 @@ void load_program() {
 	FILE * fp;
 	int i, word;
 	uint32_t address;
+	double start = now_seconds();
 
 	/* Open program file. */
 	fp = fopen(prog_file, "r");
@@ -274,6 +1975,7 @@ void load_program() {
 	PROGRAM_SIZE = i/4;
 	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
 	fclose(fp);
+	STATS.load_time = now_seconds() - start;
 }
 
 /************************************************************/
@@ -290,138 +1992,251 @@ int32_t sext_32(uint32_t value, int bit_count) { // works for both signed and un
 }
 
 
+/***************************************************************/
+/* Split an instruction word into its fields                   */
+/***************************************************************/
+void decode_instruction(uint32_t word, instruction_t *d) {
+	/* AND --> Masking, OR ---> Merging*/
+	d->word = word;
+	d->opcode = word & 127;
+	d->rd = (word >> 7) & 31; // var = (ins >> start_index_of_the_bit -1) & (2^length_of_field)
+	d->rs1 = (word >> 15) & 31;
+	d->rs2 = (word >> 20) & 31;
+	d->funct3 = (word >> 12) & 7;
+	d->funct7 = (word >> 25) & 127;
+	d->shamt = d->rs2;
+
+	d->immI = sext_32(word >> 20, 12);
+	d->immS = sext_32((d->funct7 << 5) | d->rd, 12);
+	d->immU = word >> 12;
+
+	d->immB = sext_32(((word >> 31) << 12)	// imm[12]
+	| (((word >> 7) & 1) << 11)		// imm[11]
+	| (((word >> 25) & 0b111111) << 5)	// imm[10:5]
+	| (((word >> 8) & 0b1111) << 1), 13);	// imm[4:1]
+
+	d->immJ = sext_32(((word >> 31) << 20)	// imm[20]
+	| (((word >> 12) & 0b11111111) << 12)	// imm[19:12]
+	| (((word >> 20) & 1) << 11)		// imm[11]
+	| (((word >> 21) & 0b1111111111) << 1), 21);	// imm[10:1]
+}
+
+/***************************************************************/
+/* Mnemonic of a supported RV32IM instruction, NULL otherwise  */
+/***************************************************************/
+static const char *R_NAMES[8] = { "add", "sll", "slt", "sltu", "xor", "srl", "or", "and" };
+static const char *M_NAMES[8] = { "mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu" };
+static const char *I_NAMES[8] = { "addi", NULL, "slti", "sltiu", "xori", NULL, "ori", "andi" };
+static const char *LOAD_NAMES[8] = { "lb", "lh", "lw", NULL, "lbu", "lhu", NULL, NULL };
+static const char *STORE_NAMES[8] = { "sb", "sh", "sw", NULL, NULL, NULL, NULL, NULL };
+static const char *BRANCH_NAMES[8] = { "beq", "bne", NULL, NULL, "blt", "bge", "bltu", "bgeu" };
+
+const char *instruction_name(const instruction_t *d) {
+	switch (d->opcode) {
+		case 0b0110011:
+		if (d->funct7 == 0) {
+			return R_NAMES[d->funct3];
+		}
+		if (d->funct7 == 1) {
+			return M_NAMES[d->funct3];
+		}
+		if (d->funct7 == 32) {
+			return d->funct3 == 0 ? "sub" : d->funct3 == 5 ? "sra" : NULL;
+		}
+		return NULL;
+
+		case 0b0010011:
+		if (d->funct3 == 1) {
+			return d->funct7 == 0 ? "slli" : NULL;
+		}
+		if (d->funct3 == 5) {
+			return d->funct7 == 0 ? "srli" : d->funct7 == 32 ? "srai" : NULL;
+		}
+		return I_NAMES[d->funct3];
+
+		case 0b0110111: return "lui";
+		case 0b0010111: return "auipc";
+		case 0b0000011: return LOAD_NAMES[d->funct3];
+		case 0b0100011: return STORE_NAMES[d->funct3];
+		case 0b1100011: return BRANCH_NAMES[d->funct3];
+		case 0b1101111: return "jal";
+		case 0b1100111: return d->funct3 == 0 ? "jalr" : NULL;
+		case 0b1110011:
+		if (d->funct3 == 2 && d->rs1 == 0 && (d->word >> 20) == CSR_MHARTID) {
+			return "csrr";
+		}
+		return d->word == 0b1110011 ? "ecall" : NULL;
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* Build the word back from the fields its format uses         */
+/***************************************************************/
+uint32_t encode_instruction(const instruction_t *d) {
+	uint32_t base = (d->funct3 << 12) | (d->rs1 << 15) | d->opcode;
+	uint32_t imm;
+
+	switch (d->opcode) {
+		case 0b0110011:	/* R */
+		return (d->funct7 << 25) | (d->rs2 << 20) | base | (d->rd << 7);
+
+		case 0b0010011:	/* I, shifts keep funct7 above shamt */
+		if (d->funct3 == 1 || d->funct3 == 5) {
+			return (d->funct7 << 25) | (d->shamt << 20) | base | (d->rd << 7);
+		}
+		/* fall through */
+		case 0b0000011:
+		case 0b1100111:
+		case 0b1110011:
+		return ((uint32_t) d->immI << 20) | base | (d->rd << 7);
+
+		case 0b0100011:	/* S */
+		imm = d->immS;
+		return (((imm >> 5) & 127) << 25) | (d->rs2 << 20) | base | ((imm & 31) << 7);
+
+		case 0b1100011:	/* B */
+		imm = d->immB;
+		return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0b111111) << 25) | (d->rs2 << 20) | base
+			| (((imm >> 1) & 0b1111) << 8) | (((imm >> 11) & 1) << 7);
+
+		case 0b0110111:	/* U */
+		case 0b0010111:
+		return (d->immU << 12) | (d->rd << 7) | d->opcode;
+
+		case 0b1101111:	/* J */
+		imm = d->immJ;
+		return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0b1111111111) << 21) | (((imm >> 11) & 1) << 20)
+			| (((imm >> 12) & 0b11111111) << 12) | (d->rd << 7) | d->opcode;
+	}
+	return d->word;
+}
+
 	//PC memorydeki adressi gosterir
-void handle_instruction()
+uint32_t handle_instruction()
 {
 	/*YOU NEED TO IMPLEMENT THIS*/
 	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
-	int current_ins = mem_read_32(CURRENT_STATE.PC);
+	uint32_t current_ins = mem_read_32(CURRENT_STATE.PC);
 	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
-	
-
-	/* AND --> Masking, OR ---> Merging*/
-	uint32_t opcode = current_ins & 127;
-	uint32_t rd = ( current_ins >> 7) & 31; // var = (ins >> start_index_of_the_bit -1) & (2^length_of_field)
-	uint32_t rs1 = ( current_ins >> 15) & 31; // bastaki sayısı shiftleyerek buluyoruz, bit sayıs o operandın bit sayıs (2^5 -1, 0 dan da baslıo cnku)
-	uint32_t rs2 = ( current_ins >> 20) & 31;
-	uint32_t funct3 = ( current_ins >> 12) & 7;
-	uint32_t funct7 = ( current_ins >> 25) & 127;
-
-	uint32_t immI = (current_ins >> 20) & 0b111111111111; //2^(12) - 1
-	uint32_t immS = (funct7 << 5) | rd;
-	uint32_t immU = (current_ins >> 12) & 0b11111111111111111111;
-
-	uint32_t immB = (((((funct7 >> 6) << 1) | (rd & 1)) << 10) // imm[12]
-	| ((funct7 & 0b111111 /*6 bits*/) << 4 )  // imm[10:5]
-	| ((rd >> 1) & 0b1111 /*4 bits*/)) << 1;  // imm[4:1]
-	
-	uint32_t immJ = ((((((immU >> 19) << 8) // imm i başa getiriyosun
-	| (immU & 0b11111111)) << 1) //imm[19:12]
-	| ((immU >> 8) & 1) << 10)  
-	| ((immU >> 9) & 0b1111111111)) << 1; //imm[10:1]
-
-	uint32_t shamt = (immI & 0b11111); //  imm[5:0], 2^5 - 1 // hem unsigned hem de signed de işe yarıo (arastır bi)
-	uint32_t s_shamt = (int32_t) (immI & 0b11111); // only signed
+	if (UNDO_LOG) {
+		undo_record(current_ins);
+	}
 
+	instruction_t d;
+	decode_instruction(current_ins, &d);
+	uint32_t opcode = d.opcode, rd = d.rd, rs1 = d.rs1, rs2 = d.rs2;
+	uint32_t funct3 = d.funct3, funct7 = d.funct7, shamt = d.shamt;
+	int32_t immI = d.immI, immS = d.immS, immB = d.immB, immJ = d.immJ;
+	uint32_t a = CURRENT_STATE.REGS[rs1], b = CURRENT_STATE.REGS[rs2];
 
 	// >> sağ shift, << sol shift
 
-	/* 2^12 - 1 */ // 00000101010010101 // shifleyip and le masklıyoruz => 0000000000000000000001100011 misal
-
 	switch(opcode) { // ADD opcode in binary den hex hali ,hex seklinde tanımlıoz 
 		case 0x33:
 		if (funct7 == 0) { // func3 ü 0 olan, ADD dan baska opcode lar de var o yuzden bi if daha acıoz içine
 			if (funct3 == 0) {
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] + CURRENT_STATE.REGS[rs2]; // rs2 is alwyas in the same place
+				NEXT_STATE.REGS[rd] = a + b; // rs2 is alwyas in the same place
 			}
 
 			if (funct3 == 1) { // sll
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] << CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a << (b & 31);
 			}
 
 			if (funct3 == 2) { // slt
-				if(sext_32(CURRENT_STATE.REGS[rs1],5) < sext_32(CURRENT_STATE.REGS[rs2],5)) {
-				NEXT_STATE.REGS[rd] = 1;
-				}
-				else {
-				NEXT_STATE.REGS[rd] = 0;
-				}
+				NEXT_STATE.REGS[rd] = (int32_t) a < (int32_t) b;
 			}
 
 			if (funct3 == 3) { // sltu
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] < CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a < b;
 			}
 
 			if (funct3 == 4){ // xor
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] ^ CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a ^ b;
 			}
 
 			if (funct3 == 5) { // SRL
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] >> CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a >> (b & 31);
 			}
 
 			if (funct3 == 6) { //or
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] | CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a | b;
+			}
+
+			if (funct3 == 7) { //and
+				NEXT_STATE.REGS[rd] = a & b;
 			}
 		}
 
 		if (funct7 == 1) {
 			if (funct3==0) { // mul
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] * CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a * b;
+			}
+			if (funct3==1) { // mulh
+				NEXT_STATE.REGS[rd] = ((int64_t)(int32_t) a * (int64_t)(int32_t) b) >> 32;
+			}
+			if (funct3==2) { // mulhsu
+				NEXT_STATE.REGS[rd] = ((int64_t)(int32_t) a * (int64_t) b) >> 32;
+			}
+			if (funct3==3) { // mulhu
+				NEXT_STATE.REGS[rd] = ((uint64_t) a * b) >> 32;
+			}
+			/* division by zero and INT_MIN / -1 have defined results, the host would trap */
+			if (funct3==4) { // div
+				NEXT_STATE.REGS[rd] = b == 0 ? 0xFFFFFFFF
+					: (a == 0x80000000 && b == 0xFFFFFFFF) ? a : (uint32_t)((int32_t) a / (int32_t) b);
 			}
 			if (funct3==5) { // divu
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] / (uint32_t)CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = b == 0 ? 0xFFFFFFFF : a / b;
+			}
+			if (funct3==6) { // rem
+				NEXT_STATE.REGS[rd] = b == 0 ? a
+					: (a == 0x80000000 && b == 0xFFFFFFFF) ? 0 : (uint32_t)((int32_t) a % (int32_t) b);
 			}
-
-			if (funct3==4) { // div
-				NEXT_STATE.REGS[rd] = sext_32(CURRENT_STATE.REGS[rs1], 5) / sext_32(CURRENT_STATE.REGS[rs2],5);
+			if (funct3==7) { // remu
+				NEXT_STATE.REGS[rd] = b == 0 ? a : a % b;
 			}
 		}
 
 		if(funct7 == 32) { 
 			if (funct3 == 0) { //sub
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] - CURRENT_STATE.REGS[rs2];
+				NEXT_STATE.REGS[rd] = a - b;
 			}
 			// u unsigned - << u x[rs2]
 			if (funct3 == 5 ) { // SRA (signed srl)
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] >> sext_32(CURRENT_STATE.REGS[rs2], 5);
+				NEXT_STATE.REGS[rd] = (int32_t) a >> (b & 31);
 			}
 		}
 		break;
 
 		case 0b0010011: // I - types
 		if (funct3 == 0) {
-			printf("addi %d %d\n", sext_32(immI,12), immI);
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] + sext_32(immI,12); // length is 12 in ı type immediate
+			NEXT_STATE.REGS[rd] = a + immI; // length is 12 in ı type immediate
 		}
 		if (funct3 ==2) { //slti
-			if(sext_32(CURRENT_STATE.REGS[rs1],5) < sext_32(immI,12)) {
-				NEXT_STATE.REGS[rd] = 1;
-			}
-			else {
-				NEXT_STATE.REGS[rd] = 0;
-			}
+			NEXT_STATE.REGS[rd] = (int32_t) a < immI;
 		}
-		if (funct3 ==3) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] < sext_32(immI,12);
+		if (funct3 ==3) { //sltiu
+			NEXT_STATE.REGS[rd] = a < (uint32_t) immI;
 		}
 		if (funct3 ==4) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] ^ sext_32(immI,12);
+			NEXT_STATE.REGS[rd] = a ^ immI;
 		}
 		if (funct3 ==6) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] | sext_32(immI,12);
+			NEXT_STATE.REGS[rd] = a | immI;
 		}
 		if (funct3 ==7) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] & sext_32(immI,12); // andi
+			NEXT_STATE.REGS[rd] = a & immI; // andi
 		}
-		if (funct3 ==1) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] << shamt;
+		if (funct3 ==1 && funct7 == 0) {
+			NEXT_STATE.REGS[rd] = a << shamt;
 		}
 		if (funct3 ==5) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] >> shamt;
-
-			if (funct7 ==1) {
-			NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] >> (int32_t)shamt;
+			if (funct7 == 0) {
+				NEXT_STATE.REGS[rd] = a >> shamt;
+			}
+			if (funct7 == 32) { // srai
+				NEXT_STATE.REGS[rd] = (int32_t) a >> shamt;
 			}
 		}
 		break;
@@ -429,53 +2244,59 @@ void handle_instruction()
 		/*	U-Type	*/
 
 		case 0b0110111:		// LUI
-		NEXT_STATE.REGS[rd] = sext_32(immU << 12, 20); //DEĞİŞTİRİLDİ ??? MANTIK YANLIŞ OLABİLİR
+		NEXT_STATE.REGS[rd] = d.immU << 12;
 		break;
 
 		case 0b0010111:   	//AUPIC
-		NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + sext_32(immU << 12,20);  //DEĞİŞTİRİLDİ ??? MANTIK YANLIŞ OLABİLİR
+		NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + (d.immU << 12);
 		break;
 
 		/*	Load/Store İnstructions*/
 
 		case 0b0000011:
+		if (WATCH_PAGES && (WATCH_PAGES[(a + immI) >> GUEST_PAGE_SHIFT] & WATCH_READ)) {
+			watch_check(a + immI, WATCH_READ, 0);
+		}
 		if (funct3 == 0) // LB
 		{
-			NEXT_STATE.REGS[rd] = sext_32(mem_read_32(CURRENT_STATE.REGS[rs1] + sext_32(immI,12)) & 0b11111111, 8); // [7:0] length(8) 2^8 - 1 // masking to get 8 bit ( mem_write_32 is 32 bit)
+			NEXT_STATE.REGS[rd] = sext_32(mem_read_32(a + immI) & 0b11111111, 8); // [7:0] length(8) 2^8 - 1 // masking to get 8 bit ( mem_write_32 is 32 bit)
 		}
 
 		if (funct3 == 1) // LH
 		{
-			NEXT_STATE.REGS[rd] = sext_32(mem_read_32(CURRENT_STATE.REGS[rs1] + sext_32(immI,12)) & 0b111111111111111, 16); // [15:0] length(16), 2^16-1, masking to get 8 bit
+			NEXT_STATE.REGS[rd] = sext_32(mem_read_32(a + immI) & 0xFFFF, 16); // [15:0] length(16), 2^16-1
 		}
 
 		if (funct3 == 2) // LW
 		{
-			NEXT_STATE.REGS[rd] = sext_32(mem_read_32(CURRENT_STATE.REGS[rs1] + sext_32(immI,12)) & 0b11111111111111111111111111111111, 32); // [31:0] length(32) 2^32-1 
+			NEXT_STATE.REGS[rd] = mem_read_32(a + immI); // [31:0]
 		}
 
 		if (funct3 == 4) // LBU
 		{
-			NEXT_STATE.REGS[rd] = mem_read_32((CURRENT_STATE.REGS[rs1] + sext_32(immI,12))) & 0b11111111;// [7:0] //x[rd] = M[x[rs1] + sext(offset)][7:0]
+			NEXT_STATE.REGS[rd] = mem_read_32(a + immI) & 0b11111111;// [7:0] //x[rd] = M[x[rs1] + sext(offset)][7:0]
 		}
 
 		if (funct3 == 5) // LHU
 		{
-			NEXT_STATE.REGS[rd] = mem_read_32((CURRENT_STATE.REGS[rs1] +sext_32(immI,12))) & 0b111111111111111;// [7:0] //x[rd] = M[x[rs1] + sext(offset)][7:0]
+			NEXT_STATE.REGS[rd] = mem_read_32(a + immI) & 0xFFFF;// [15:0]
 		}
 		break;
 
 		case 0b0100011:
+		if (WATCH_PAGES && (WATCH_PAGES[(a + immS) >> GUEST_PAGE_SHIFT] & WATCH_WRITE)) {
+			watch_check(a + immS, WATCH_WRITE, funct3 == 0 ? b & 0xFF : funct3 == 1 ? b & 0xFFFF : b);
+		}
 		if(funct3==0) { //sb
-			mem_write_32(CURRENT_STATE.REGS[rs1] + sext_32(immS,12), CURRENT_STATE.REGS[rs2] & 0b11111111); //byte sext ==> [11:5] 7 bit
+			mem_write_8(a + immS, b); //byte, the rest of the word is left alone
 		}
 
 		if(funct3==1) { //sh
-			mem_write_32(CURRENT_STATE.REGS[rs1] + sext_32(immS,12), CURRENT_STATE.REGS[rs2] & 0b1111111111111111);//half
+			mem_write_16(a + immS, b);//half
 		}
 
 		if(funct3==2) { //sw
-			mem_write_32(CURRENT_STATE.REGS[rs1] + sext_32(immS,12), CURRENT_STATE.REGS[rs2] & 0b11111111111111111111111111111111);//word
+			mem_write_32(a + immS, b);//word
 		}
 		break;
 
@@ -483,66 +2304,73 @@ void handle_instruction()
 		/*	B-Type Format	*/
 		case 0b1100011:
 		if (funct3==0) { //beq
-			if(CURRENT_STATE.REGS[rs1] == CURRENT_STATE.REGS[rs2])
+			if(a == b)
 			{
-				NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immB,12);
+				NEXT_STATE.PC = CURRENT_STATE.PC + immB;
 			}
 		}
 
 		if (funct3==1) { //bne
-			if(CURRENT_STATE.REGS[rs1] != CURRENT_STATE.REGS[rs2])
+			if(a != b)
 			{
-				NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immB,12);
+				NEXT_STATE.PC = CURRENT_STATE.PC + immB;
 			}
 		}
 
-		if (funct3==4) { // blt ==========> HATA OLABİLİR
-			if (sext_32(CURRENT_STATE.REGS[rs1],5) < sext_32(CURRENT_STATE.REGS[rs2], 5))
+		if (funct3==4) { // blt
+			if ((int32_t) a < (int32_t) b)
 			{
-				NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immB,12);
+				NEXT_STATE.PC = CURRENT_STATE.PC + immB;
 			}
 		}
 
 		if (funct3==5) { // bge
-			if (sext_32(CURRENT_STATE.REGS[rs1],5) >= sext_32(CURRENT_STATE.REGS[rs2], 5))
+			if ((int32_t) a >= (int32_t) b)
 			{
-				NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immB,12);
+				NEXT_STATE.PC = CURRENT_STATE.PC + immB;
 			}
 		}
 
 		if (funct3==6) { // bltu
-			if(CURRENT_STATE.REGS[rs1] < CURRENT_STATE.REGS[rs2])
+			if(a < b)
 			{
-				NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immB,12);
+				NEXT_STATE.PC = CURRENT_STATE.PC + immB;
 			}
 		}
 
 		if (funct3==7) { // bgeu
-			if(CURRENT_STATE.REGS[rs1] >= (int32_t) CURRENT_STATE.REGS[rs2])
+			if(a >= b)
 			{
-				NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immB,12);
+				NEXT_STATE.PC = CURRENT_STATE.PC + immB;
 			}
 		}
 		break;
 		/*	J-Type format	*/
 		case 0b1101111:
 		NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 4; //x[rd] = pc+4;
-		NEXT_STATE.PC = CURRENT_STATE.PC + sext_32(immJ, 20); //pc += sext(offset)
+		NEXT_STATE.PC = CURRENT_STATE.PC + immJ; //pc += sext(offset)
+		break;
 
 		//CURRENT_STATE.REGS[17] // this is x17 (17.th register)
 
-		/* ECALL */
+		/* ECALL, and csrr rd, mhartid: the only CSR there is */
 		case 0b1110011: 
+		if (funct3 == 2 && rs1 == 0 && (current_ins >> 20) == CSR_MHARTID) {
+			NEXT_STATE.REGS[rd] = HART->hartid;
+			break;
+		}
 		RUN_FLAG = FALSE;
 		break;
 
 		
 		case 0b1100111:
 		NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 4;		//t =pc+4;
-		NEXT_STATE.PC = CURRENT_STATE.REGS[rd] +sext_32(immI,12);	//NEXT_STATE.PC = (CURRENT_STATE.REGS[rs1] + sext_32(immI, 12)) &  ~1; // ;  ~1 complement the value "1"
+		NEXT_STATE.PC = (a + immI) & ~1;	// ~1 complement the value "1"
 		break;
 
 	}
+	NEXT_STATE.REGS[0] = 0;	/* x0 is hardwired */
+	return current_ins;
 }
 
 
@@ -554,9 +2382,7 @@ void handle_instruction()
 /************************************************************/
 void initialize() { 
 	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	init_harts();
 }
 
 /**********************************************************************/
@@ -565,12 +2391,17 @@ void initialize() {
 void print_program(){
 	int i;
 	uint32_t addr;
+	out_buf_t out;
 	
+	out_init(&out, STDOUT_FILENO);
 	for(i=0; i<PROGRAM_SIZE; i++){
 		addr = MEM_TEXT_BEGIN + (i*4);
-		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+		out_str(&out, "[0x");
+		out_printf(&out, "%x", addr);
+		out_str(&out, "]\t");
+		format_instruction(&out, addr);
 	}
+	out_free(&out);
 }
 
 
@@ -578,128 +2409,73 @@ void print_program(){
 /* Print the instruction at given memory address (in RISC-V assembly format)  */
 /******************************************************************************/
 void print_instruction(uint32_t addr){
-	/*YOU NEED TO IMPLEMENT THIS FUNCTION*/
-
-	int current_ins = mem_read_32(addr); // addr değişkenini verion hep adresi yenilesin
-	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
-
-	
-
+	char text[128];
+	out_buf_t out = { text, 0, sizeof(text), -1 };
+	format_instruction(&out, addr);
+	printf("%.*s", (int) out.len, out.data);
+}
 
-	/* AND --> Masking, OR ---> Merging*/
-	uint32_t opcode = current_ins & 127;
-	uint32_t rd = ( current_ins >> 7) & 31; // var = (ins >> start_index_of_the_bit -1) & (2^length_of_field)
-	uint32_t rs1 = ( current_ins >> 15) & 31; // bastaki sayısı shiftleyerek buluyoruz, bit sayıs o operandın bit sayıs (2^5 -1, 0 dan da baslıo cnku)
-	uint32_t rs2 = ( current_ins >> 20) & 31;
-	uint32_t funct3 = ( current_ins >> 12) & 7;
-	uint32_t funct7 = ( current_ins >> 25) & 127;
-
-	uint32_t immI = (current_ins >> 20) & 0b111111111111; //2^(12) - 1
-	uint32_t immS = (funct7 << 5) | rd;
-	uint32_t immU = (current_ins >> 12) & 0b11111111111111111111;
-
-	uint32_t immB = (((((funct7 >> 6) << 1) | (rd & 1)) << 10) // imm[12]
-	| ((funct7 & 0b111111 /*6 bits*/) << 4 )  // imm[10:5]
-	| ((rd >> 1) & 0b1111 /*4 bits*/)) << 1;  // imm[4:1]
-	
-	uint32_t immJ = ((((((immU >> 19) << 8) // imm i başa getiriyosun
-	| (immU & 0b11111111)) << 1) //imm[19:12]
-	| ((immU >> 8) & 1) << 10)  
-	| ((immU >> 9) & 0b1111111111)) << 1; //imm[10:1]
 
-	uint32_t shamt = (immI & 0b11111); //  imm[5:0], 2^5 - 1 // hem unsigned hem de signed de işe yarıo (arastır bi)
-	uint32_t s_shamt = (int32_t) (immI & 0b11111); // only signed
+/******************************************************************************/
+/* Format the instruction at given memory address (in RISC-V assembly format) */
+/******************************************************************************/
+void format_instruction(out_buf_t *out, uint32_t addr){
+	format_word(out, mem_peek_32(addr)); // addr değişkenini verion hep adresi yenilesin
+}
 
+/* one line for a supported instruction, nothing for anything else */
+void format_word(out_buf_t *out, uint32_t word){
+	instruction_t d;
+	decode_instruction(word, &d);
+	uint32_t rd = d.rd, rs1 = d.rs1, rs2 = d.rs2, funct3 = d.funct3, funct7 = d.funct7;
 
-	switch(opcode) { // ADD opcode in binary den hex hali ,hex seklinde tanımlıoz 
+	switch(d.opcode) { // ADD opcode in binary den hex hali ,hex seklinde tanımlıoz 
 		case 0b0110011:
-		if (funct7 == 0) { // func3 ü 0 olan, ADD dan baska opcode lar de var o yuzden bi if daha acıoz içine
-			if (funct3 == 0) {
-				printf("add x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-
-			if (funct3 == 1) { // sll
-				printf("sll x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-
-			if (funct3 == 2) { // slt
-				printf("slt x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-
-			if (funct3 == 3) { // sltu
-				printf("sltu x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-
-			if (funct3 == 4){ // xor
-				printf("xor x%d, x%d, x%d\n",rd, rs1,rs2);
-			}
-
-			if (funct3 == 5) { // SRL
-				printf("srl x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-
-			if (funct3 == 6) { //or
-				printf("or x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-
-			if (funct3 == 7) { //and
-				printf("and x%d, x%d, x%d\n",rd,rs1,rs2);
-			}
-		}
-
-		if (funct7 == 1) {
-			if (funct3==0) { // mul
-				printf("mul x%d, x%d, x%d\n",rd,rs1,sext_32(rs2,5));
-			}
-			if (funct3==1) { // divu
-				printf("divu x%d, x%d,x %d\n",rd,rs1,sext_32(rs2,5));
-			}
-
-			if (funct3==4) { // div
-				printf("div x%d, x%d,x %d\n",rd,rs1,sext_32(rs2,5));
-			}
+		if (funct7 == 0 || funct7 == 1) { // base and M extension share the layout
+			out_printf(out, "%s x%d, x%d, x%d\n", funct7 ? M_NAMES[funct3] : R_NAMES[funct3], rd, rs1, rs2);
 		}
 
 		if(funct7 == 32) { 
-			if (funct3 == 7) { //sub
-				printf("sub x%d, x%d, x%d\n",rd,rs1,rs2);
+			if (funct3 == 0) { //sub
+				out_printf(out, "sub x%d, x%d, x%d\n",rd,rs1,rs2);
 			}
 			// SLT signed o haftaya https://msyksphinz-self.github.io/riscv-isadoc/html/rvi.html da s olarak o var. signed oluomus
 			// u unsigned - << u x[rs2]
 			if (funct3 == 5 ) { // SRA (signed srl)
-				printf("sra x%d, x%d, x%d\n",rd, rs1, sext_32(rs2,5));
+				out_printf(out, "sra x%d, x%d, x%d\n",rd, rs1, rs2);
 			}
 		}
 		break;
 
 	case 0b0010011: // I - types
 	if (funct3 == 0) { //ADDI
-		 printf("addi\tx%d, x%d, 0x%d\n", rd,rs1,sext_32(immI,12));
+		 out_printf(out, "addi\tx%d, x%d, %d\n", rd,rs1,d.immI);
 	}
 	if (funct3 ==2) {
-		 printf("slti x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
+		 out_printf(out, "slti x%d, x%d, 0x%x\n", rd,rs1,d.immI);
 	}
 	if (funct3 ==3) {
-		 printf("sltiu x%d, x%d, 0x%x\n",rd,rs1,sext_32(immI,12));
+		 out_printf(out, "sltiu x%d, x%d, 0x%x\n",rd,rs1,d.immI);
 
 	}
 	if (funct3 ==4) {
-		 printf("xori x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
+		 out_printf(out, "xori x%d, x%d, 0x%x\n", rd,rs1,d.immI);
 	}
 	if (funct3 ==6) {
-		 printf("ori x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
+		 out_printf(out, "ori x%d, x%d, 0x%x\n", rd,rs1,d.immI);
 	}
 	if (funct3 ==7) {
-		 printf("andi x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
+		 out_printf(out, "andi x%d, x%d, 0x%x\n", rd,rs1,d.immI);
 	}
-	if (funct3 ==1) {
-		 printf("slli x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
+	if (funct3 ==1 && funct7 == 0) {
+		 out_printf(out, "slli x%d, x%d, 0x%x\n", rd,rs1,d.shamt);
 	}
 	if (funct3 ==5) {
-		 printf("srli x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
-
-		if (funct7 ==1) {
-		 	printf("srai x%d, x%d, 0x%x\n", rd,rs1,sext_32(immI,12));
+		if (funct7 == 0) {
+		 	out_printf(out, "srli x%d, x%d, 0x%x\n", rd,rs1,d.shamt);
+		}
+		if (funct7 == 32) {
+		 	out_printf(out, "srai x%d, x%d, 0x%x\n", rd,rs1,d.shamt);
 		}
 	}
 	break;
@@ -707,101 +2483,850 @@ void print_instruction(uint32_t addr){
 	/*	U-Type	*/
 
 	case 0b0110111:		// LUI
-	printf("lui x%d, %d\n", rd,sext_32(immU,12));
+	out_printf(out, "lui x%d, 0x%x\n", rd,d.immU);
 	break;
 
 	case 0b0010111:   	//AUPIC
-	printf("auipc x%d, %d\n", rd,sext_32(immU,12));
+	out_printf(out, "auipc x%d, 0x%x\n", rd,d.immU);
 	break;
 
 	/*	Load/Store İnstructions*/
 
 	case 0b0000011:
-	if (funct3 == 0) // LB
-	{
-		printf("lb x%d, %d(0x%x)\n", rd,sext_32(immI,12),rs1); // immI == offseet
+	if (LOAD_NAMES[funct3]) {
+		out_printf(out, "%s x%d, %d(x%d)\n", LOAD_NAMES[funct3], rd, d.immI, rs1); // immI == offseet
 	}
+	break;
 
-	if (funct3 == 1) // LH
-	{
-		printf("lh x%d, %d(0x%x)\n", rd,sext_32(immI,12),rs1); // immI == offseet
+	case 0b0100011:
+	if (STORE_NAMES[funct3]) {
+		out_printf(out, "%s x%d, %d(x%d)\n", STORE_NAMES[funct3], rs2, d.immS, rs1);
 	}
+	break;
 
-	if (funct3 == 2) // LW
-	{
-		printf("lw  x%d, %d(0x%x)\n", rd,sext_32(immI,12),rs1); // immI == offseet
+
+	/*	B-Type Format	*/
+	case 0b1100011:
+	if (BRANCH_NAMES[funct3]) {
+		out_printf(out, "%s x%d, x%d, %d\n", BRANCH_NAMES[funct3], rs1, rs2, d.immB);
 	}
+	break;
+
+	/*	J-Type format	*/
+	case 0b1101111:
+		out_printf(out, "jal x%d, %d\n",rd,d.immJ);  
+	break;
 
-	if (funct3 == 4) // LBU
-	{
-		printf("lbu  x%d, %d(0x%x)\n", rd,sext_32(immI,12),rs1); // immI == offseet
+	case 0b1100111:
+	if (funct3 == 0) {
+		out_printf(out, "jalr x%d, %d(x%d)\n",rd,d.immI,rs1);  
 	}
+	break;
 
-	if (funct3 == 5) // LHU
-	{
-		printf("lhu  x%d,  %d(0x%x)\n", rd,sext_32(immI,12),rs1); // immI == offseet
+		//CURRENT_STATE.REGS[17] // this is x17 (17.th register)
+		/* ECALL */
+
+	case 0b1110011:
+	if (word == 0b1110011) {
+		out_printf(out, "ecall\n");
+	}
+	if (funct3 == 2 && rs1 == 0 && (word >> 20) == CSR_MHARTID) {
+		out_printf(out, "csrr x%d, mhartid\n", rd);
 	}
 	break;
 
-	case 0b0100011:
-	if(funct3==0) { //sb
-		printf("sb x%d, %d(0x%x)\n", rs2,sext_32(immS,12),rs1); // 
 	}
+}
+
+/***************************************************************/
+/* Differential fuzzing (--fuzz). Random valid RV32IM programs */
+/* run through every engine from the same start state, and the */
+/* final states must agree. Control flow only goes forward so  */
+/* every program reaches its closing ecall. x3 holds the base  */
+/* of the data window that loads and stores go through, x4 the */
+/* start of the text for jalr. Neither is ever written.        */
+/***************************************************************/
+#define FUZZ_MAX_PROGRAM 512	/* words, jalr off(x4) reaches all of them */
+#define FUZZ_JUMP 8		/* furthest jump in words, short so most of a program runs */
+#define FUZZ_WINDOW (FUZZ_DATA_BASE - FUZZ_DATA_SIZE / 2)
+#define FUZZ_REPORTS 4
+
+#define FUZZ_QUANTUM 7	/* store buffers committed every few instructions */
+
+static const char *FUZZ_ENGINE_NAMES[FUZZ_ENGINES] = { "cycle", "fast", "debug", "undo", "mmap", "harts", "2harts" };
+enum { FUZZ_CYCLE, FUZZ_FAST, FUZZ_DEBUG, FUZZ_UNDO, FUZZ_MMAP, FUZZ_HARTS, FUZZ_TWO_HARTS };
+
+typedef struct {
+	CPU_State state;
+	uint64_t count;
+	int run_flag;
+	uint8_t data[FUZZ_DATA_SIZE];
+} fuzz_state_t;
+
+static uint64_t fuzz_seed = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64* */
+static uint64_t fuzz_rand() {
+	fuzz_seed ^= fuzz_seed >> 12;
+	fuzz_seed ^= fuzz_seed << 25;
+	fuzz_seed ^= fuzz_seed >> 27;
+	return fuzz_seed * 0x2545F4914F6CDD1DULL;
+}
+
+/* any register but the two bases */
+static uint32_t fuzz_reg() {
+	uint32_t r;
+	do {
+		r = fuzz_rand() & 31;
+	} while (r == 3 || r == 4);
+	return r;
+}
+
+/* register values biased towards the edge cases of div/rem/shifts/compares */
+static uint32_t fuzz_value() {
+	static const uint32_t edges[] = { 0, 1, 31, 32, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0xFFFFFFE0 };
+	uint64_t r = fuzz_rand();
+	return (r & 3) == 0 ? edges[(r >> 8) & 7] : (uint32_t)(r >> 32);
+}
+
+/* a load/store offset that keeps the whole word inside the window; */
+/* half of them overlap around x3 so loads see recent stores         */
+static int32_t fuzz_offset() {
+	uint64_t r = fuzz_rand();
+	if (r & 1) {
+		return (int32_t)((r >> 1) % 24) - 8;
+	}
+	return (int32_t)((r >> 1) % (FUZZ_DATA_SIZE - 3)) - FUZZ_DATA_SIZE / 2;
+}
+
+/* forward target slot after i, at most max_words away and never past the ecall */
+static uint32_t fuzz_target(uint32_t i, uint32_t length, uint32_t max_words) {
+	uint32_t room = length - 1 - i;
+	return i + 1 + fuzz_rand() % (room < max_words ? room : max_words);
+}
+
+static uint32_t fuzz_program(uint32_t *program) {
+	static const uint32_t loads[] = { 0, 1, 2, 4, 5 };
+	static const uint32_t branches[] = { 0, 1, 4, 5, 6, 7 };
+	uint32_t length = 16 + fuzz_rand() % (FUZZ_MAX_PROGRAM - 15);
+	uint32_t i, kind;
+	instruction_t d;
+
+	for (i = 0; i < length - 1; i++) {
+		memset(&d, 0, sizeof(d));
+		d.rd = fuzz_reg();
+		d.rs1 = fuzz_rand() & 31;
+		d.rs2 = fuzz_rand() & 31;
+		d.funct3 = fuzz_rand() & 7;
+		kind = fuzz_rand() % 100;
+
+		if (kind < 30) {
+			static const uint32_t funct7s[] = { 0, 1, 32 };
+			d.opcode = 0b0110011;
+			d.funct7 = funct7s[fuzz_rand() % 3];
+			if (d.funct7 == 32) {
+				d.funct3 = d.funct3 & 1 ? 5 : 0;
+			}
+		} else if (kind < 50) {
+			d.opcode = 0b0010011;
+			d.immI = sext_32(fuzz_rand(), 12);
+			d.shamt = fuzz_rand() & 31;
+			d.funct7 = d.funct3 == 5 && (fuzz_rand() & 1) ? 32 : 0;
+		} else if (kind < 55) {
+			d.opcode = kind & 1 ? 0b0110111 : 0b0010111;
+			d.immU = fuzz_rand() & 0xFFFFF;
+		} else if (kind < 70) {
+			d.opcode = 0b0000011;
+			d.funct3 = loads[fuzz_rand() % 5];
+			d.rs1 = 3;
+			d.immI = fuzz_offset();
+		} else if (kind < 80) {
+			d.opcode = 0b0100011;
+			d.funct3 = fuzz_rand() % 3;
+			d.rs1 = 3;
+			d.immS = fuzz_offset();
+		} else if (kind < 92) {
+			d.opcode = 0b1100011;
+			d.funct3 = branches[fuzz_rand() % 6];
+			d.immB = (fuzz_target(i, length, FUZZ_JUMP) - i) * 4;
+		} else if (kind < 97) {
+			d.opcode = 0b1101111;
+			d.immJ = (fuzz_target(i, length, FUZZ_JUMP) - i) * 4;
+		} else {
+			d.opcode = 0b1100111;
+			d.funct3 = 0;
+			d.rs1 = 4;
+			d.immI = fuzz_target(i, length, FUZZ_JUMP) * 4;
+		}
+		program[i] = encode_instruction(&d);
+	}
+	program[length - 1] = 0b1110011;	/* ecall */
+	return length;
+}
+
+/***************************************************************/
+/* Program 0 is directed: byte and halfword stores, one of     */
+/* them across a word boundary, must leave the bytes around    */
+/* them alone. fuzz_narrow_expect() patches the start data.    */
+/***************************************************************/
+static const struct {
+	uint32_t funct3;
+	int32_t offset;
+} FUZZ_NARROW[] = { { 0, 1 }, { 1, 6 }, { 1, 11 }, { 0, -1 }, { 1, -3 } };
+#define FUZZ_NARROW_COUNT (sizeof(FUZZ_NARROW) / sizeof(FUZZ_NARROW[0]))
+#define FUZZ_NARROW_REG 5
+
+static uint32_t fuzz_narrow_program(uint32_t *program) {
+	instruction_t d;
+	uint32_t i;
+
+	for (i = 0; i < FUZZ_NARROW_COUNT; i++) {
+		memset(&d, 0, sizeof(d));
+		d.opcode = 0b0100011;
+		d.funct3 = FUZZ_NARROW[i].funct3;
+		d.rs1 = 3;
+		d.rs2 = FUZZ_NARROW_REG;
+		d.immS = FUZZ_NARROW[i].offset;
+		program[i] = encode_instruction(&d);
+	}
+	program[i] = 0b1110011;	/* ecall */
+	return i + 1;
+}
 
-	if(funct3==1) { //sh
-		printf("sh x%d, %d(0x%x)\n", rs2,sext_32(immS,12),rs1); // 
+static void fuzz_narrow_expect(const fuzz_state_t *init, fuzz_state_t *expect) {
+	uint32_t value = init->state.REGS[FUZZ_NARROW_REG], i, j;
+
+	*expect = *init;
+	for (i = 0; i < FUZZ_NARROW_COUNT; i++) {
+		uint32_t at = FUZZ_DATA_BASE + FUZZ_NARROW[i].offset - FUZZ_WINDOW;
+		for (j = 0; j <= FUZZ_NARROW[i].funct3; j++) {
+			expect->data[at + j] = value >> (8 * j);
+		}
 	}
+	/* the stores write no register, ecall retires and stops the run */
+	expect->state.PC = MEM_TEXT_BEGIN + 4 * (FUZZ_NARROW_COUNT + 1);
+	expect->count = FUZZ_NARROW_COUNT + 1;
+	expect->run_flag = FALSE;
+}
 
-	if(funct3==2) { //sw
-		printf("sw x%d, %d(0x%x)\n", rs2,sext_32(immS,12),rs1); // 
+static void fuzz_load(const uint32_t *program, uint32_t length, const fuzz_state_t *init) {
+	uint32_t i;
+	for (i = 0; i < length; i++) {
+		mem_write_32(MEM_TEXT_BEGIN + 4 * i, program[i]);
 	}
-	break;
+	memcpy(guest_to_host(FUZZ_WINDOW, NULL), init->data, FUZZ_DATA_SIZE);
+	CURRENT_STATE = NEXT_STATE = init->state;
+	INSTRUCTION_COUNT = 0;
+	RUN_FLAG = TRUE;
+}
 
+static void fuzz_snapshot(fuzz_state_t *s) {
+	s->state = CURRENT_STATE;
+	s->count = INSTRUCTION_COUNT;
+	s->run_flag = RUN_FLAG;
+	memcpy(s->data, guest_to_host(FUZZ_WINDOW, NULL), FUZZ_DATA_SIZE);
+}
 
-	/*	B-Type Format	*/
-	case 0b1100011:
-	if (funct3==0) { //beq
-		printf("beq x%d, x%d, %d\n", rs1,rs2,sext_32(immB,12)); // 
+/* put hart 1 at the start of the program with its own registers */
+static void fuzz_second_hart(const fuzz_state_t *init) {
+	HARTS[1].current = HARTS[1].next = init->state;
+	HARTS[1].instruction_count = 0;
+	HARTS[1].run_flag = TRUE;
+}
+
+/***************************************************************/
+/* Reference for the two-hart engine, on one thread and with   */
+/* no store buffer: each quantum every hart runs from the      */
+/* memory of the quantum's start, its stores are recorded and  */
+/* then replayed in hart order.                                */
+/***************************************************************/
+static struct {
+	uint32_t address, value;
+	int bytes;
+} fuzz_stores[2][FUZZ_QUANTUM];
+static uint32_t fuzz_num_stores[2];
+
+static void fuzz_store_hook(uint32_t address, uint32_t value, int bytes) {
+	uint32_t h = HART - HARTS, n = fuzz_num_stores[h]++;
+	fuzz_stores[h][n].address = address;
+	fuzz_stores[h][n].value = value;
+	fuzz_stores[h][n].bytes = bytes;
+}
+
+static void fuzz_two_harts_reference(const uint32_t *program, uint32_t length, const fuzz_state_t *init,
+	const fuzz_state_t *second, fuzz_state_t *reference) {
+	static uint8_t start[FUZZ_DATA_SIZE];
+	uint8_t *window = guest_to_host(FUZZ_WINDOW, NULL);
+	uint64_t left = FUZZ_MAX_PROGRAM;
+	uint32_t h, i;
+
+	fuzz_load(program, length, init);
+	fuzz_second_hart(second);
+	STORE_HOOK = fuzz_store_hook;
+	while (left > 0 && (HARTS[0].run_flag || HARTS[1].run_flag)) {
+		uint64_t quantum = left < FUZZ_QUANTUM ? left : FUZZ_QUANTUM;
+		memcpy(start, window, FUZZ_DATA_SIZE);
+		for (h = 0; h < 2; h++) {
+			memcpy(window, start, FUZZ_DATA_SIZE);
+			HART = &HARTS[h];
+			fuzz_num_stores[h] = 0;
+			for (i = 0; i < quantum && RUN_FLAG; i++) {
+				handle_instruction();
+				CURRENT_STATE = NEXT_STATE;
+				INSTRUCTION_COUNT++;
+			}
+		}
+		memcpy(window, start, FUZZ_DATA_SIZE);
+		for (h = 0; h < 2; h++) {
+			for (i = 0; i < fuzz_num_stores[h]; i++) {
+				memory_write(fuzz_stores[h][i].address, fuzz_stores[h][i].value, fuzz_stores[h][i].bytes);
+			}
+		}
+		left -= quantum;
+	}
+	STORE_HOOK = NULL;
+	for (h = 0; h < 2; h++) {
+		HART = &HARTS[h];
+		fuzz_snapshot(&reference[h]);
+	}
+	HART = &HARTS[0];
+}
+
+/* print the first difference, TRUE if there was one */
+static int fuzz_differs(const char *what, const fuzz_state_t *want, const fuzz_state_t *got) {
+	int i;
+	if (want->state.PC != got->state.PC || want->count != got->count || want->run_flag != got->run_flag) {
+		printf("%s: PC 0x%08x/0x%08x, count %llu/%llu, run flag %d/%d\n", what, want->state.PC, got->state.PC,
+			(unsigned long long) want->count, (unsigned long long) got->count, want->run_flag, got->run_flag);
+		return TRUE;
+	}
+	for (i = 0; i < RISCV_REGS; i++) {
+		if (want->state.REGS[i] != got->state.REGS[i]) {
+			printf("%s: x%d 0x%08x/0x%08x\n", what, i, want->state.REGS[i], got->state.REGS[i]);
+			return TRUE;
+		}
+	}
+	for (i = 0; i < FUZZ_DATA_SIZE; i++) {
+		if (want->data[i] != got->data[i]) {
+			printf("%s: byte 0x%08x 0x%02x/0x%02x\n", what, FUZZ_WINDOW + i, want->data[i], got->data[i]);
+			return TRUE;
+		}
 	}
+	return FALSE;
+}
 
-	if (funct3==1) { //bne
-		printf("bne x%d, x%d , %d\n", rs1,rs2,sext_32(immB,12)); // 
+int fuzz(uint64_t num_programs) {
+	static uint32_t program[FUZZ_MAX_PROGRAM];
+	static fuzz_state_t init, expect, result[FUZZ_ENGINES];
+	static fuzz_state_t second, second_result, reference[2];
+	uint8_t *region_mem[NUM_MEM_REGION], *flat_mem[NUM_MEM_REGION], *flat_base;
+	uint64_t executed[FUZZ_ENGINES] = { 0 }, mismatches = 0, p;
+	double seconds[FUZZ_ENGINES] = { 0 };
+	uint32_t length, breaks, i;
+	undo_log_t *undo;
+	int e;
+
+	/* both memory backends, switched by swapping the region pointers */
+	MMAP_FLAG = FALSE;
+	init_memory();
+	init_harts();
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		region_mem[i] = MEM_REGIONS[i].mem;
+	}
+	init_guest_space();
+	flat_base = GUEST_BASE;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		flat_mem[i] = MEM_REGIONS[i].mem;
 	}
 
-	if (funct3==4) { // blt ==========> HATA OLABİLİR
-		printf("blt x%d, x%d , %d\n", rs1,rs2,sext_32(immB,12)); // 
+	/* the debug engine runs with a breakpoint that is never reached, the undo engine records */
+	set_breakpoint(MEM_TEXT_BEGIN + 4 * FUZZ_MAX_PROGRAM);
+	breaks = BREAK_COUNT;
+	undo_start(1);
+	undo = UNDO_LOG;
+	BREAK_COUNT = 0;
+	UNDO_LOG = NULL;
+
+	printf("Fuzzing %llu programs (seed 0x%016llx)\n", (unsigned long long) num_programs, (unsigned long long) fuzz_seed);
+	for (p = 0; p < num_programs; p++) {
+		length = p == 0 ? fuzz_narrow_program(program) : fuzz_program(program);
+		for (i = 0; i < RISCV_REGS; i++) {
+			init.state.REGS[i] = fuzz_value();
+		}
+		init.state.REGS[0] = 0;
+		init.state.REGS[3] = FUZZ_DATA_BASE;
+		init.state.REGS[4] = MEM_TEXT_BEGIN;
+		init.state.PC = MEM_TEXT_BEGIN;
+		for (i = 0; i < FUZZ_DATA_SIZE; i += 4) {
+			uint32_t value = fuzz_value();
+			memcpy(init.data + i, &value, 4);
+		}
+		init.count = 0;
+		init.run_flag = TRUE;
+		/* hart 1 of the two-hart engine runs the same program from other registers */
+		second = init;
+		for (i = 0; i < RISCV_REGS; i++) {
+			if (i != 0 && i != 3 && i != 4) {
+				second.state.REGS[i] = fuzz_value();
+			}
+		}
+
+		int failed = FALSE;
+		if (p == 0) {
+			/* every engine is checked against cycle, so checking cycle covers them all */
+			fuzz_narrow_expect(&init, &expect);
+		}
+		for (e = 0; e < FUZZ_ENGINES; e++) {
+			for (i = 0; i < NUM_MEM_REGION; i++) {
+				MEM_REGIONS[i].mem = e == FUZZ_MMAP ? flat_mem[i] : region_mem[i];
+			}
+			GUEST_BASE = e == FUZZ_MMAP ? flat_base : NULL;
+			if (e == FUZZ_TWO_HARTS) {
+				fuzz_two_harts_reference(program, length, &init, &second, reference);
+			}
+			fuzz_load(program, length, &init);
+			BREAK_COUNT = e == FUZZ_DEBUG ? breaks : 0;
+			UNDO_LOG = e == FUZZ_UNDO ? undo : NULL;
+			undo_clear();
+
+			/* hart 0 through the scheduler and its store buffer, next to an idle or a busy hart 1 */
+			HART_COUNT = e == FUZZ_HARTS || e == FUZZ_TWO_HARTS ? 2 : 1;
+			HART_QUANTUM = FUZZ_QUANTUM;
+			HARTS[1].run_flag = FALSE;
+			if (e == FUZZ_TWO_HARTS) {
+				fuzz_second_hart(&second);
+			}
+
+			double start = now_seconds();
+			if (e == FUZZ_FAST) {
+				fast_forward(FUZZ_MAX_PROGRAM);
+			} else {
+				cycle_blocks(FUZZ_MAX_PROGRAM);
+			}
+			seconds[e] += now_seconds() - start;
+			executed[e] += INSTRUCTION_COUNT;
+			fuzz_snapshot(&result[e]);
+
+			/* the two-hart engine has its own reference */
+			const fuzz_state_t *want = e == FUZZ_TWO_HARTS ? &reference[0] : &result[FUZZ_CYCLE];
+			char what[64];
+			snprintf(what, sizeof(what), "program %llu, %s vs %s", (unsigned long long) p, FUZZ_ENGINE_NAMES[e],
+				e == FUZZ_TWO_HARTS ? "sequential" : "cycle");
+			if (e != FUZZ_CYCLE && !failed && mismatches < FUZZ_REPORTS) {
+				failed = fuzz_differs(what, want, &result[e]);
+			} else if (e != FUZZ_CYCLE && !failed) {
+				failed = memcmp(&want->state, &result[e].state, sizeof(CPU_State)) != 0
+					|| want->count != result[e].count
+					|| memcmp(want->data, result[e].data, FUZZ_DATA_SIZE) != 0;
+			}
+
+			if (e == FUZZ_TWO_HARTS) {
+				HART = &HARTS[1];
+				executed[e] += INSTRUCTION_COUNT;
+				fuzz_snapshot(&second_result);
+				HART = &HARTS[0];
+				snprintf(what, sizeof(what), "program %llu, 2harts hart 1 vs sequential", (unsigned long long) p);
+				if (!failed && mismatches < FUZZ_REPORTS) {
+					failed = fuzz_differs(what, &reference[1], &second_result);
+				} else if (!failed) {
+					failed = memcmp(&reference[1].state, &second_result.state, sizeof(CPU_State)) != 0
+						|| reference[1].count != second_result.count;
+				}
+			}
+
+			if (e == FUZZ_UNDO) {
+				/* back to the start: half one entry at a time, the rest through the checkpoint */
+				fuzz_state_t back;
+				undo_steps(INSTRUCTION_COUNT / 2, TRUE);
+				undo_steps(INSTRUCTION_COUNT, FALSE);
+				fuzz_snapshot(&back);
+				snprintf(what, sizeof(what), "program %llu, undo back to start", (unsigned long long) p);
+				if (!failed && mismatches < FUZZ_REPORTS) {
+					failed = fuzz_differs(what, &init, &back);
+				} else if (!failed) {
+					failed = memcmp(&init.state, &back.state, sizeof(CPU_State)) != 0 || back.count != 0
+						|| memcmp(init.data, back.data, FUZZ_DATA_SIZE) != 0;
+				}
+			}
+		}
+
+		if (p == 0 && !failed) {
+			failed = fuzz_differs("program 0, sb/sh vs expected", &expect, &result[FUZZ_CYCLE]);
+		}
+
+		if (failed) {
+			if (mismatches < FUZZ_REPORTS) {
+				out_buf_t out;
+				out_init(&out, STDOUT_FILENO);
+				for (i = 0; i < length; i++) {
+					out_str(&out, "\t");
+					format_word(&out, program[i]);
+				}
+				out_free(&out);
+				printf("\n");
+			}
+			mismatches++;
+		}
 	}
 
-	if (funct3==5) { // bge
-		printf("bge x%d, x%d , %d\n", rs1,rs2,sext_32(immB,12)); // 
+	BREAK_COUNT = breaks;
+	UNDO_LOG = undo;
+	HART_COUNT = 1;
+	HART_QUANTUM = HART_DEFAULT_QUANTUM;
+	printf("\n%-8s %14s %10s %10s\n", "engine", "instructions", "seconds", "MIPS");
+	for (e = 0; e < FUZZ_ENGINES; e++) {
+		printf("%-8s %14llu %10.3f %10.2f\n", FUZZ_ENGINE_NAMES[e], (unsigned long long) executed[e], seconds[e],
+			seconds[e] > 0 ? executed[e] / seconds[e] / 1e6 : 0.0);
 	}
+	printf("\n%llu programs, %llu mismatches\n", (unsigned long long) num_programs, (unsigned long long) mismatches);
+	return mismatches ? 1 : 0;
+}
 
-	if (funct3==6) { // bltu
-		printf("bltu x%d, x%d , %d\n", rs1,rs2,sext_32(immB,12)); // 
+/***************************************************************/
+/* Round trip every 32-bit word (--roundtrip): a supported     */
+/* instruction re-encodes to itself and disassembles to one    */
+/* line starting with its mnemonic, anything else prints       */
+/* nothing. The space is split across one thread per core.     */
+/***************************************************************/
+#define ROUNDTRIP_REPORTS 16
+
+typedef struct {
+	pthread_t thread;
+	uint64_t first, last;	/* words [first, last) */
+	uint64_t valid, invalid, bad;
+} roundtrip_job_t;
+
+static pthread_mutex_t ROUNDTRIP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t roundtrip_reported;
+
+static void *roundtrip_thread(void *arg) {
+	roundtrip_job_t *job = arg;
+	char text[128];
+	out_buf_t out = { text, 0, sizeof(text), -1 };
+	instruction_t d;
+	uint64_t w;
+
+	for (w = job->first; w < job->last; w++) {
+		uint32_t word = (uint32_t) w;
+		const char *name;
+		size_t n;
+		int ok;
+
+		decode_instruction(word, &d);
+		name = instruction_name(&d);
+		out.len = 0;
+		format_word(&out, word);
+		if (name == NULL) {
+			job->invalid++;
+			ok = out.len == 0;
+		} else {
+			job->valid++;
+			n = strlen(name);
+			ok = encode_instruction(&d) == word && out.len > n
+				&& memcmp(text, name, n) == 0 && (text[n] == ' ' || text[n] == '\t' || text[n] == '\n')
+				&& memchr(text, '\n', out.len) == text + out.len - 1;
+		}
+		if (!ok) {
+			job->bad++;
+			pthread_mutex_lock(&ROUNDTRIP_LOCK);
+			if (roundtrip_reported++ < ROUNDTRIP_REPORTS) {
+				printf("0x%08x: %s, encodes 0x%08x, text \"%.*s\"\n", word, name ? name : "invalid",
+					encode_instruction(&d), (int) (out.len && text[out.len - 1] == '\n' ? out.len - 1 : out.len), text);
+			}
+			pthread_mutex_unlock(&ROUNDTRIP_LOCK);
+		}
 	}
+	return NULL;
+}
 
-	if (funct3==7) { // bgeu
-		printf("bne x%d, x%d , %d\n", rs1,rs2,sext_32(immB,12)); // 
+int roundtrip() {
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	roundtrip_job_t *jobs;
+	uint64_t valid = 0, invalid = 0, bad = 0, space = 1ULL << 32;
+	double start = now_seconds();
+	long t;
+
+	if (threads < 1) {
+		threads = 1;
 	}
-	break;
+	jobs = calloc(threads, sizeof(roundtrip_job_t));
+	printf("Round trip of all 2^32 words on %ld threads\n", threads);
+	for (t = 0; t < threads; t++) {
+		jobs[t].first = space * t / threads;
+		jobs[t].last = space * (t + 1) / threads;
+		pthread_create(&jobs[t].thread, NULL, roundtrip_thread, &jobs[t]);
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join(jobs[t].thread, NULL);
+		valid += jobs[t].valid;
+		invalid += jobs[t].invalid;
+		bad += jobs[t].bad;
+	}
+	free(jobs);
+	printf("%llu valid, %llu invalid, %llu mismatches (%.1f s)\n", (unsigned long long) valid,
+		(unsigned long long) invalid, (unsigned long long) bad, now_seconds() - start);
+	return bad ? 1 : 0;
+}
 
-	/*	J-Type format	*/
-	case 0b1101111:
-		printf("jal x%d, %d\n",rd,sext_32(immJ,20));  
-	break;
+/***************************************************************/
+/* Whisper log parsing. Lines look like                        */
+/*   #<tag> <hart> <pc> <insn> <r|m|c|f> <target> <value> asm  */
+/* and an instruction with several side effects repeats <tag>. */
+/***************************************************************/
 
-	case 0b1100111:
-		printf("jalr x%d, %d\n",rd,sext_32(immI,12));  
-	break;
+/* hex digit value + 1, zero for anything that is not a hex digit */
+static const uint8_t HEX_DIGIT[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static const char *skip_blanks(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	return p;
+}
 
-		//CURRENT_STATE.REGS[17] // this is x17 (17.th register)
-		/* ECALL */
+static const char *parse_hex(const char *p, const char *end, uint32_t *value) {
+	uint32_t v = 0;
+	p = skip_blanks(p, end);
+	while (p < end && HEX_DIGIT[(uint8_t) *p]) {
+		v = (v << 4) | (HEX_DIGIT[(uint8_t) *p] - 1);
+		p++;
+	}
+	*value = v;
+	return p;
+}
 
-	case 0b1110011:
-		printf("ecall\n");
-	break;
+static const char *parse_dec(const char *p, const char *end, uint64_t *value) {
+	uint64_t v = 0;
+	p = skip_blanks(p, end);
+	while (p < end && *p >= '0' && *p <= '9') {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+	*value = v;
+	return p;
+}
+
+static const char *line_end(const char *p, const char *end) {
+	const char *nl = memchr(p, '\n', end - p);
+	return nl ? nl : end;
+}
+
+/* Parse the next instruction record starting at p, returns where the next one starts */
+const char *whisper_next(const char *p, const char *end, whisper_inst_t *inst) {
+	int first = TRUE;
+
+	inst->num_regs = inst->num_mems = 0;
+	while (p < end) {
+		const char *eol = line_end(p, end);
+		const char *q = p;
+		uint64_t seq;
+		uint32_t hart, pc, insn, target, value;
+		char type;
+
+		if (*q != '#') {	/* not an instruction line */
+			p = eol + 1;
+			continue;
+		}
+		q = parse_dec(q + 1, eol, &seq);
+		if (!first && seq != inst->seq) {
+			return p;
+		}
+		q = parse_hex(q, eol, &hart);
+		q = parse_hex(q, eol, &pc);
+		q = parse_hex(q, eol, &insn);
+		q = skip_blanks(q, eol);
+		type = q < eol ? *q++ : '-';
+		q = parse_hex(q, eol, &target);
+		q = parse_hex(q, eol, &value);
+
+		if (first) {
+			inst->seq = seq;
+			inst->pc = pc;
+			inst->insn = insn;
+			inst->line = p;
+			first = FALSE;
+		}
+		inst->line_end = eol;
+		if (type == 'r' && inst->num_regs < WHISPER_MAX_WRITES) {
+			inst->reg[inst->num_regs] = target;
+			inst->reg_value[inst->num_regs++] = value;
+		} else if (type == 'm' && inst->num_mems < WHISPER_MAX_WRITES) {
+			inst->mem[inst->num_mems] = target;
+			inst->mem_value[inst->num_mems++] = value;
+		}
+		p = eol + 1;
+	}
+	return first ? NULL : end;
+}
+
+/* stores made by the instruction being compared */
+static int compare_num_stores;
+static uint32_t compare_store_addr[WHISPER_MAX_WRITES], compare_store_value[WHISPER_MAX_WRITES];
+
+static void compare_store_hook(uint32_t address, uint32_t value, int bytes) {
+	if (compare_num_stores < WHISPER_MAX_WRITES) {
+		compare_store_addr[compare_num_stores] = address;
+		compare_store_value[compare_num_stores] = value;
+	}
+	compare_num_stores++;
+}
+
+/* one instruction outside the run loops, FALSE if it faulted */
+static int guarded_cycle() {
+	if (GUEST_BASE) {
+		FAULT_ARMED = TRUE;
+		if (sigsetjmp(FAULT_JMP, 0)) {
+			guest_fault();
+			return FALSE;
+		}
+	}
+	cycle();
+	FAULT_ARMED = FALSE;
+	return TRUE;
+}
+
+/**********************************************************************/
+/* Step the loaded program against a Whisper instruction log and      */
+/* report the first divergence. The log is mapped, not read, and the  */
+/* pages already compared are dropped so memory use stays bounded.    */
+/* Both must start at the same PC: rebasing would only move the PCs,  */
+/* not what auipc, jal and jalr write to rd.                          */
+/**********************************************************************/
+int compare_whisper_log(const char *log_file) {
+	whisper_inst_t context[WHISPER_CONTEXT];
+	whisper_inst_t inst;
+	uint32_t before[RISCV_REGS];
+	uint64_t count = 0, records = 0;
+	struct stat st;
+	char reason[128];
+	int fd, i, j;
+
+	fd = open(log_file, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Can't open Whisper log %s\n", log_file);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		printf("Error: Can't open Whisper log %s\n", log_file);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		printf("Whisper log %s is empty.\n", log_file);
+		close(fd);
+		return -1;
+	}
+	const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		printf("Error: Can't map Whisper log %s\n", log_file);
+		return -1;
+	}
+	madvise((void *) base, st.st_size, MADV_SEQUENTIAL);
+
+	const char *end = base + st.st_size;
+	const char *p = base;
+	const char *released = base;
+	const size_t release_chunk = 64 << 20;
+
+	STORE_HOOK = compare_store_hook;
+	reason[0] = '\0';
+	printf("Comparing against %s...\n\n", log_file);
+	while ((p = whisper_next(p, end, &inst)) != NULL) {
+		if (records == 0 && inst.pc != CURRENT_STATE.PC) {
+			printf("Error: Whisper starts at 0x%08x but the program is loaded at 0x%08x, link it there.\n\n",
+				inst.pc, CURRENT_STATE.PC);
+			STORE_HOOK = NULL;
+			munmap((void *) base, st.st_size);
+			return -1;
+		}
+		context[records++ % WHISPER_CONTEXT] = inst;
+
+		if (RUN_FLAG == FALSE) {
+			snprintf(reason, sizeof(reason), "ozu-riscv32 stopped, Whisper continues");
+			break;
+		}
+		uint32_t pc = CURRENT_STATE.PC;
+		if (inst.pc != pc) {
+			snprintf(reason, sizeof(reason), "PC: whisper 0x%08x, ozu 0x%08x", inst.pc, pc);
+			break;
+		}
+
+		memcpy(before, CURRENT_STATE.REGS, sizeof(before));
+		compare_num_stores = 0;
+		if (!guarded_cycle()) {
+			snprintf(reason, sizeof(reason), "ozu-riscv32 faulted, Whisper continues");
+			break;
+		}
+		count++;
+
+		/* every register Whisper wrote must hold the same value */
+		for (i = 0; i < inst.num_regs && !reason[0]; i++) {
+			if (inst.reg[i] < RISCV_REGS && CURRENT_STATE.REGS[inst.reg[i]] != inst.reg_value[i]) {
+				snprintf(reason, sizeof(reason), "x%u: whisper 0x%08x, ozu 0x%08x",
+					inst.reg[i], inst.reg_value[i], CURRENT_STATE.REGS[inst.reg[i]]);
+			}
+		}
+		/* and ozu must not have written any other register */
+		for (i = 0; i < RISCV_REGS && !reason[0]; i++) {
+			if (CURRENT_STATE.REGS[i] == before[i]) {
+				continue;
+			}
+			for (j = 0; j < inst.num_regs && inst.reg[j] != i; j++);
+			if (j == inst.num_regs) {
+				snprintf(reason, sizeof(reason), "x%d: not written by whisper, ozu wrote 0x%08x", i, CURRENT_STATE.REGS[i]);
+			}
+		}
+		if (!reason[0] && compare_num_stores != inst.num_mems) {
+			snprintf(reason, sizeof(reason), "memory writes: whisper %d, ozu %d", inst.num_mems, compare_num_stores);
+		}
+		for (i = 0; i < inst.num_mems && !reason[0]; i++) {
+			if (inst.mem[i] != compare_store_addr[i] || inst.mem_value[i] != compare_store_value[i]) {
+				snprintf(reason, sizeof(reason), "memory: whisper [0x%08x]=0x%08x, ozu [0x%08x]=0x%08x",
+					inst.mem[i], inst.mem_value[i], compare_store_addr[i], compare_store_value[i]);
+			}
+		}
+		if (reason[0]) {
+			break;
+		}
+
+		/* drop log pages we are done with */
+		if (p - released >= release_chunk) {
+			size_t length = (p - released) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+			madvise((void *) released, length, MADV_DONTNEED);
+			released += length;
+		}
+	}
+	STORE_HOOK = NULL;
+
+	if (!reason[0] && p == NULL && RUN_FLAG) {
+		snprintf(reason, sizeof(reason), "Whisper log ended, ozu-riscv32 still running");
+	}
+	if (!reason[0]) {
+		printf("No divergence in %llu instructions.\n\n", (unsigned long long) count);
+		munmap((void *) base, st.st_size);
+		return 0;
+	}
 
+	printf("Divergence at instruction %llu (whisper #%llu): %s\n",
+		(unsigned long long) count, (unsigned long long) inst.seq, reason);
+	printf("-------------------------------------------------------------\n");
+	printf("Whisper context:\n");
+	uint64_t k;
+	for (k = records > WHISPER_CONTEXT ? records - WHISPER_CONTEXT : 0; k < records; k++) {
+		whisper_inst_t *c = &context[k % WHISPER_CONTEXT];
+		printf("\t%.*s\n", (int)(c->line_end - c->line), c->line);
 	}
+	printf("ozu-riscv32:\n\t[0x%08x]\t", inst.pc);
+	print_instruction(inst.pc);
+	printf("-------------------------------------------------------------\n\n");
+	munmap((void *) base, st.st_size);
+	return 1;
 }
 
 /***************************************************************/
@@ -812,14 +3337,66 @@ int main(int argc, char *argv[]) {
 	printf("Welcome to OZU-RISCV SIMULATOR...\n");
 	printf("*********************************\n\n");
 	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+	int i;
+	const char *compare_file = NULL;
+	prog_file[0] = '\0';
+	STATS_FILE = stderr;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+			compare_file = argv[++i];
+		} else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+			exit(fuzz(strtoull(argv[++i], NULL, 0)));
+		} else if (strcmp(argv[i], "--roundtrip") == 0) {
+			exit(roundtrip());
+		} else if (strcmp(argv[i], "--mmap") == 0) {
+			MMAP_FLAG = TRUE;
+		} else if (strcmp(argv[i], "--heatmap") == 0) {
+			heat_start();
+		} else if (strcmp(argv[i], "--harts") == 0 && i + 1 < argc) {
+			HART_COUNT = atoi(argv[++i]);
+			if (HART_COUNT < 1 || HART_COUNT > MAX_HARTS) {
+				printf("Error: --harts takes 1 to %d\n", MAX_HARTS);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+			unsigned long quantum = strtoul(argv[++i], NULL, 0);
+			if (quantum > HART_MAX_QUANTUM) {
+				printf("Error: --quantum takes 1 to %d\n", HART_MAX_QUANTUM);
+				exit(1);
+			}
+			HART_QUANTUM = quantum < 1 ? HART_DEFAULT_QUANTUM : quantum;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			STATS_FLAG = TRUE;
+		} else if (strncmp(argv[i], "--stats=", 8) == 0) {
+			STATS_FLAG = TRUE;
+			STATS_FILE = fopen(argv[i] + 8, "w");
+			if (STATS_FILE == NULL) {
+				printf("Error: Can't open stats file %s\n", argv[i] + 8);
+				exit(1);
+			}
+		} else {
+			strncpy(prog_file, argv[i], sizeof(prog_file) - 1);
+		}
+	}
+
+	if (prog_file[0] == '\0') {
+		printf("Error: You should provide input file.\nUsage: %s [--stats[=<file>]] [--mmap] [--heatmap] [--harts <n> [--quantum <n>]] [--compare <whisper log>] <input program> \n       %s --fuzz <n> | --roundtrip\n\n",  argv[0], argv[0]);
 		exit(1);
 	}
 
-	strcpy(prog_file, argv[1]);
 	initialize();
 	load_program();
+	if (compare_file) {
+		exit(compare_whisper_log(compare_file) == 0 ? 0 : 1);
+	}
+
+	/* only the interactive loop pauses on Ctrl-C, batch modes die as usual */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sa, NULL);
+
 	help();
 	while (1){
 		handle_command();
@@ -1,4 +1,8 @@
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
 
 #define FALSE 0
 #define TRUE  1
@@ -28,6 +32,12 @@ mem_region_t MEM_REGIONS[] = {
 };
 
 #define NUM_MEM_REGION 2
+
+/* guest pages written since the last reset, one bit each; the loader's writes count */
+#define GUEST_PAGE_SHIFT 12
+uint8_t WRITTEN_PAGES[1 << (32 - GUEST_PAGE_SHIFT - 3)];
+#define PAGE_WRITTEN(address) (WRITTEN_PAGES[(address) >> (GUEST_PAGE_SHIFT + 3)] & (1 << (((address) >> GUEST_PAGE_SHIFT) & 7)))
+uint32_t LAST_WRITTEN_PAGE = UINT32_MAX;	/* already marked, stores to it skip the bitmap */
 #define RISCV_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -39,16 +49,242 @@ typedef struct CPU_State_Struct {
 
 
 /***************************************************************/
-/* CPU State info.                                             */
+/* Harts. Every hart has its own state and store buffer. While */
+/* several harts run, each one only sees its own stores until  */
+/* the end of the quantum, when the buffers are committed in   */
+/* hart order, so a run does not depend on host scheduling.    */
+/***************************************************************/
+#define MAX_HARTS 64
+#define HART_DEFAULT_QUANTUM 10000
+#define HART_MAX_QUANTUM (1 << 16)	/* 256K buffer slots of 16 bytes: 4 MB per hart */
+#define CSR_MHARTID 0xF14
+
+typedef struct {
+	uint32_t address;	/* word aligned */
+	uint32_t value;
+	uint32_t mask;		/* bytes of value written, one bit each; 0 for a free slot */
+} store_entry_t;
+
+typedef struct {
+	store_entry_t *slots;	/* open addressing on the word address */
+	uint32_t *order;	/* used slots in the order first written */
+	uint32_t capacity, used;
+} store_buffer_t;
+
+typedef struct {
+	CPU_State current, next;
+	int run_flag;
+	uint64_t instruction_count;
+	uint64_t opcode_count[128];	/* retired instructions per major opcode */
+	uint32_t hartid;
+	int buffered;		/* stores go to the buffer, not to memory */
+	store_buffer_t stores;
+} hart_t;
+
+hart_t HARTS[MAX_HARTS];
+uint32_t HART_COUNT = 1;
+uint32_t HART_QUANTUM = HART_DEFAULT_QUANTUM;	/* instructions per hart between commits */
+__thread hart_t *HART = &HARTS[0];	/* the hart this thread runs or the REPL shows */
+
+/***************************************************************/
+/* CPU State info (of the calling thread's hart).              */
 /***************************************************************/
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
+#define CURRENT_STATE (HART->current)
+#define NEXT_STATE (HART->next)
+#define RUN_FLAG (HART->run_flag)	/* run flag*/
+#define INSTRUCTION_COUNT (HART->instruction_count)
+#define OPCODE_COUNT (HART->opcode_count)
+int TRACE_FLAG;	/* print each instruction executed by cycle() */
 uint32_t PROGRAM_SIZE; /*in words*/
 
 char prog_file[32]; /*name of input file*/
 
+/***************************************************************/
+/* Run statistics (reported as JSON with --stats)              */
+/***************************************************************/
+typedef struct {
+	double load_time;		/* seconds spent in load_program() */
+	double run_time;		/* seconds spent simulating since reset */
+} sim_stats_t;
+
+sim_stats_t STATS;
+int STATS_FLAG;	/* print JSON stats at the end of each run */
+FILE *STATS_FILE;	/* stderr unless --stats=<file> is given */
+
+/***************************************************************/
+/* Background simulation. The worker polls SIM_INTERRUPT only  */
+/* between blocks of SIM_BLOCK instructions.                   */
+/***************************************************************/
+#define SIM_BLOCK 4096
+#define SIM_STOP  1	/* end the current run, RUN_FLAG is kept */
+#define SIM_PAUSE 2	/* park at the next block boundary */
+
+typedef struct {
+	char command;	/* 's'im, 'r'un or s'a'mple */
+	uint32_t arg1, arg2;
+} sim_job_t;
+
+pthread_t SIM_THREAD;
+pthread_mutex_t SIM_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SIM_COND = PTHREAD_COND_INITIALIZER;
+int SIM_ACTIVE;		/* a job is running on SIM_THREAD */
+int SIM_JOINABLE;	/* SIM_THREAD has not been joined yet */
+int SIM_PAUSED;		/* the worker is parked for the REPL */
+atomic_int SIM_INTERRUPT;
+sim_job_t SIM_JOB;
+
+/***************************************************************/
+/* Breakpoints and watchpoints. Run loops only switch to the   */
+/* checking path while BREAK_COUNT or WATCH_COUNT is non-zero. */
+/***************************************************************/
+#define TEXT_WORDS ((MEM_TEXT_END - MEM_TEXT_BEGIN) / 4)
+#define WATCH_READ  1
+#define WATCH_WRITE 2
+#define MAX_WATCHPOINTS 64
+
+uint8_t *BREAK_MAP;	/* one flag per text word, allocated on first break */
+uint32_t BREAK_COUNT;
+uint8_t *WATCH_PAGES;	/* watch kinds per guest page, allocated on first watch */
+uint32_t WATCH_ADDR[MAX_WATCHPOINTS];
+uint8_t WATCH_KIND[MAX_WATCHPOINTS];
+int WATCH_COUNT;
+int DEBUG_HIT;		/* a breakpoint or watchpoint stopped the run */
+int STEP_OVER;		/* don't stop on a breakpoint at the resume PC */
+int BREAK_STOPPED;	/* the last run stopped on the breakpoint at BREAK_STOP_PC */
+uint32_t BREAK_STOP_PC;
+
+/***************************************************************/
+/* Undo log for reverse execution (rstep/rcontinue). One entry */
+/* per instruction in a ring carved out of a single arena,     */
+/* plus a register checkpoint every UNDO_CHECKPOINT_INTERVAL.  */
+/***************************************************************/
+#define UNDO_DEFAULT_MB 64
+#define UNDO_CHECKPOINT_INTERVAL 65536
+
+typedef struct {
+	uint32_t pc;	/* PC of the instruction */
+	uint32_t where;	/* register (< RISCV_REGS) or memory address it wrote */
+	uint32_t old;	/* value before the write */
+} undo_entry_t;
+
+typedef struct {
+	uint64_t seq;	/* log position the state was taken at */
+	CPU_State state;
+} undo_checkpoint_t;
+
+typedef struct {
+	uint8_t *arena;
+	undo_entry_t *entries;
+	undo_checkpoint_t *checkpoints;
+	uint64_t capacity, cp_capacity;
+	uint64_t head, tail;		/* next and oldest entry */
+	uint64_t cp_head, cp_tail;	/* next and oldest checkpoint */
+} undo_log_t;
+
+undo_log_t *UNDO_LOG;	/* NULL when not recording */
+
+/***************************************************************/
+/* Memory-access heatmap (--heatmap). Counters live in one     */
+/* heat_page_t per touched guest page, found through a two     */
+/* level directory, so untouched space costs nothing.          */
+/***************************************************************/
+#define HEAT_LINE_SHIFT 6	/* 64-byte lines, 64 per page so one bit each fits a uint64_t */
+#define HEAT_LINES (1 << (GUEST_PAGE_SHIFT - HEAT_LINE_SHIFT))
+#define HEAT_DIR_BITS 10	/* pages per second-level table */
+#define HEAT_EPOCH 100000	/* instructions per working-set sample */
+#define HEAT_TOP 16		/* hottest lines / load PCs / working-set rows reported */
+
+#define HEAT_TEXT  0
+#define HEAT_DATA  1
+#define HEAT_STACK 2		/* loads and stores based on sp (x2) */
+#define HEAT_FETCH 0
+#define HEAT_READ  1
+#define HEAT_WRITE 2
+
+typedef struct {
+	uint32_t count[HEAT_LINES];	/* accesses per line */
+	uint64_t epoch_lines;		/* lines touched in the current epoch */
+	uint32_t epoch;			/* last epoch the page was touched in */
+} heat_page_t;
+
+typedef struct {
+	uint32_t pc;		/* load instruction, 0 for a free slot */
+	uint32_t last;		/* its previous address */
+	int32_t stride;		/* last distance between two of its addresses */
+	uint32_t count, repeats;	/* loads, and loads that repeated the stride */
+} heat_stride_t;
+
+typedef struct {
+	heat_page_t **dir[1 << (32 - GUEST_PAGE_SHIFT - HEAT_DIR_BITS)];
+	uint32_t pages;			/* heat_page_t allocated */
+	uint64_t split[3][3];		/* [text/data/stack][fetch/read/write] */
+	uint64_t instructions;
+	uint32_t epoch, epoch_capacity;
+	uint32_t *ws_pages, *ws_lines;	/* distinct pages/lines per epoch */
+	heat_stride_t *strides;		/* open addressing on the load PC */
+	uint32_t stride_capacity, stride_used;
+} heat_map_t;
+
+heat_map_t *HEAT_MAP;	/* NULL when not instrumenting */
+
+/***************************************************************/
+/* Flat guest memory (--mmap). The whole 4 GB space is one     */
+/* reservation, addresses outside the regions are PROT_NONE    */
+/* and accesses to them fault back into the run loop.          */
+/***************************************************************/
+#define GUEST_SPACE (1ULL << 32)
+#define GUEST_HOT_SIZE (16 << 20)	/* hugepage-backed bytes at the hot ends of each region */
+
+int MMAP_FLAG;
+uint8_t *GUEST_BASE;	/* host address of guest 0, NULL with the region backend */
+uint64_t GUEST_SPAN;	/* reserved bytes, including the trailing guard page */
+__thread sigjmp_buf FAULT_JMP;
+__thread int FAULT_ARMED;
+__thread uint32_t FAULT_ADDRESS;
+
+/* buffered output for the dump commands */
+typedef struct {
+	char *data;
+	size_t len, size;
+	int fd;		/* -1 to only fill the buffer */
+} out_buf_t;
+
+/* called for every store when set, value holds the low <bytes> bytes */
+void (*STORE_HOOK)(uint32_t address, uint32_t value, int bytes);
+
+/***************************************************************/
+/* One retired instruction from a Whisper log (--compare)      */
+/***************************************************************/
+#define WHISPER_MAX_WRITES 4
+#define WHISPER_CONTEXT 8
+
+typedef struct {
+	uint64_t seq;			/* Whisper instruction tag */
+	uint32_t pc, insn;
+	int num_regs, num_mems;
+	uint32_t reg[WHISPER_MAX_WRITES], reg_value[WHISPER_MAX_WRITES];
+	uint32_t mem[WHISPER_MAX_WRITES], mem_value[WHISPER_MAX_WRITES];
+	const char *line, *line_end;	/* log text of the record, for context */
+} whisper_inst_t;
+
+/***************************************************************/
+/* A decoded instruction word. Immediates are already sign     */
+/* extended (immU is the raw 20 bits), the executor, the       */
+/* disassembler and the fuzzer all decode through this.        */
+/***************************************************************/
+typedef struct {
+	uint32_t word;
+	uint32_t opcode, rd, rs1, rs2, funct3, funct7;
+	int32_t immI, immS, immB, immJ;
+	uint32_t immU, shamt;
+} instruction_t;
+
+/* engines cross-checked by --fuzz */
+#define FUZZ_ENGINES 7
+#define FUZZ_DATA_BASE 0x10010000	/* x3 points here, x4 at the text */
+#define FUZZ_DATA_SIZE 4096
+
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
@@ -56,17 +292,77 @@ char prog_file[32]; /*name of input file*/
 void help();
 uint32_t mem_read_32(uint32_t address);
 void mem_write_32(uint32_t address, uint32_t value);
+void mem_write_16(uint32_t address, uint32_t value);
+void mem_write_8(uint32_t address, uint32_t value);
+uint32_t mem_peek_32(uint32_t address);
+void init_guest_space();
+void guest_fault();
 void cycle();
+void init_harts();
+int harts_running();
+uint64_t harts_instructions();
+void harts_opcode_count(uint64_t *counts);
+int harts_refuse();
+int harts_run(uint64_t num_instructions);
+double now_seconds();
+uint32_t count_written_pages();
+void print_stats();
 void run(int num_cycles);
 void runAll();
+uint64_t fast_forward(uint64_t num_instructions);
+int cycle_blocks(uint64_t num_instructions);
+int sim_poll();
+void sim_start(char command, uint32_t arg1, uint32_t arg2);
+void sim_pause();
+void sim_resume();
+void sim_stop();
+void sim_wait();
+void set_breakpoint(uint32_t address);
+void set_watchpoint(uint32_t address, int kind);
+void watch_check(uint32_t address, int kind, uint32_t value);
+uint64_t debug_steps(uint64_t num_instructions, int detailed);
+void undo_start(uint32_t megabytes);
+void undo_stop();
+void undo_clear();
+void undo_record(uint32_t instruction);
+void undo_unrecord();
+uint64_t undo_steps(uint64_t num_instructions, int stop_at_break);
+void heat_start();
+void heat_stop();
+void heat_clear();
+void heat_fetch(uint32_t pc);
+void heat_access(uint32_t address, uint32_t pc, uint32_t base_reg, int kind);
+void heat_instruction();
+void print_heatmap();
+void sample(uint32_t skip, uint32_t window);
 void mdump(uint32_t start, uint32_t stop) ;
+void mdump_raw(const char *file, uint32_t start, uint32_t stop);
+void out_init(out_buf_t *out, int fd);
+void out_flush(out_buf_t *out);
+void out_free(out_buf_t *out);
+void out_str(out_buf_t *out, const char *s);
+void out_hex32(out_buf_t *out, uint32_t value);
+void out_dec(out_buf_t *out, int64_t value);
+void out_printf(out_buf_t *out, const char *format, ...);
+uint8_t *guest_to_host(uint32_t address, uint64_t *avail);
+int guest_page_written(uint32_t address);
 void rdump();
 void handle_command();
 void reset();
 void init_memory();
 void load_program();
-void handle_instruction(); /*YOU SHOULD IMPLEMENT THIS*/
+uint32_t handle_instruction(); /*YOU SHOULD IMPLEMENT THIS*/
 void initialize();
 void print_program(); /*YOU SHOULD IMPLEMENT THIS*/
 void print_instruction(uint32_t);
+void format_instruction(out_buf_t *out, uint32_t addr);
+void format_word(out_buf_t *out, uint32_t word);
+int32_t sext_32(uint32_t value, int bit_count);
+void decode_instruction(uint32_t word, instruction_t *d);
+uint32_t encode_instruction(const instruction_t *d);
+const char *instruction_name(const instruction_t *d);
+int fuzz(uint64_t num_programs);
+int roundtrip();
+const char *whisper_next(const char *p, const char *end, whisper_inst_t *inst);
+int compare_whisper_log(const char *log_file);
 